@@ -0,0 +1,497 @@
+// CMSC 341 - Fall 2023 - Project 4
+// Throughput and latency benchmark for CarDB
+//
+// usage: ./bench [--sizes=101,1009,...] [--ops=N] [--mix=R:I:U:D] [--models=K]
+//                [--policy=quadratic|doublehash|group|robinhood|all] [--keymode=model|composite]
+//                [--batch=N] [--threads=T] [--shards=N] [--background=B] [--budget=S]
+//                [--adaptive] [--journal=MICROS]
+//                [--format=csv|json] [--out=file]
+//
+// For every policy and table size the benchmark loads `size` unique cars and then
+// runs each mix of findCar (R), insert (I), updateQuantity (U) and remove (D) calls.
+// Every run reports ops/sec, p50/p99/p999/max latency in nanoseconds and the average
+// number of probe steps per call. --mix may be given several times. With --batch the
+// load phase goes through insertBatch in chunks of N cars and its latency is per car.
+// With --threads every run is repeated on a ShardedCarDB of --shards shards (default
+// 4 per thread) driven by T threads; ops/sec is then the total over all threads.
+// --background hands migration to a worker thread that scans B old slots per step,
+// --budget makes every insert and remove scan S old slots instead.
+// --adaptive lets every table leave its policy when probing degrades; runs keep
+// the name of the policy they started with.
+// --journal records every change in bench_journal.bin with a group commit every
+// MICROS microseconds (0 syncs every call); the file is deleted after each run.
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "dealer.h"
+#include "sharded.h"
+
+unsigned int hashCode(const string str) {
+	unsigned int val = 0;
+	const unsigned int thirtyThree = 33;  // magic number from textbook
+	for (unsigned int i = 0; i < str.length(); i++)
+		val = val * thirtyThree + str[i];
+	return val;
+}
+
+enum op_t { OP_READ, OP_INSERT, OP_UPDATE, OP_REMOVE, NUM_OPS, OP_INSERT_BATCH = NUM_OPS };
+const char* OP_NAMES[NUM_OPS + 1] = { "findCar", "insert", "updateQuantity", "remove", "insertBatch" };
+const char* JOURNAL_FILE = "bench_journal.bin";
+
+struct Mix {
+	string name;            // as given on the command line, e.g. "90:5:3:2"
+	int weight[NUM_OPS];    // relative weight of every operation
+};
+
+struct Result {
+	string policy;
+	long long size;         // number of cars loaded before the run
+	string phase;           // "load" or the mix name
+	string op;
+	long long count;
+	double seconds;
+	double opsPerSec;
+	long long p50, p99, p999, max;  // latency in nanoseconds
+	double avgProbes;
+	long long finalCap;
+	double lambda;
+};
+
+class Bench {
+public:
+	Bench() : m_ops(10000), m_models(1000), m_batch(0), m_threads(0), m_shards(0), m_background(0), m_budget(0), m_adaptive(false), m_journal(-1), m_keyMode(MODELKEY), m_format("table"), m_generator(10) {
+		long long sizes[] = { 101, 1009, 10007, 100003 };
+		m_sizes.assign(sizes, sizes + 4);
+		m_policies.push_back(QUADRATIC);
+		m_policies.push_back(DOUBLEHASH);
+		m_policies.push_back(GROUPPROBE);
+		m_policies.push_back(ROBINHOOD);
+	}
+
+	bool parseArgs(int argc, char** argv) {
+		vector<Mix> mixes;
+		for (int i = 1; i < argc; i++) {
+			string arg = argv[i];
+			string value = arg.substr(arg.find('=') + 1);
+			if (arg.compare(0, 8, "--sizes=") == 0) {
+				m_sizes.clear();
+				stringstream ss(value);
+				string item;
+				while (getline(ss, item, ','))
+					m_sizes.push_back(atoll(item.c_str()));
+			}
+			else if (arg.compare(0, 6, "--ops=") == 0)
+				m_ops = atoll(value.c_str());
+			else if (arg.compare(0, 8, "--batch=") == 0)
+				m_batch = max(0, atoi(value.c_str()));
+			else if (arg.compare(0, 10, "--threads=") == 0)
+				m_threads = max(0, atoi(value.c_str()));
+			else if (arg.compare(0, 13, "--background=") == 0)
+				m_background = max(0LL, atoll(value.c_str()));
+			else if (arg.compare(0, 9, "--budget=") == 0)
+				m_budget = max(0LL, atoll(value.c_str()));
+			else if (arg == "--adaptive")
+				m_adaptive = true;
+			else if (arg.compare(0, 10, "--journal=") == 0)
+				m_journal = max(0LL, atoll(value.c_str()));
+			else if (arg.compare(0, 9, "--shards=") == 0)
+				m_shards = max(1, atoi(value.c_str()));
+			else if (arg.compare(0, 9, "--models=") == 0)
+				m_models = max(1, atoi(value.c_str()));
+			else if (arg.compare(0, 6, "--mix=") == 0) {
+				Mix mix;
+				if (!parseMix(value, mix))
+					return false;
+				mixes.push_back(mix);
+			}
+			else if (arg.compare(0, 9, "--policy=") == 0) {
+				m_policies.clear();
+				if (value == "quadratic" || value == "all")
+					m_policies.push_back(QUADRATIC);
+				if (value == "doublehash" || value == "all")
+					m_policies.push_back(DOUBLEHASH);
+				if (value == "group" || value == "all")
+					m_policies.push_back(GROUPPROBE);
+				if (value == "robinhood" || value == "all")
+					m_policies.push_back(ROBINHOOD);
+				if (m_policies.empty())
+					return false;
+			}
+			else if (arg.compare(0, 10, "--keymode=") == 0) {
+				if (value != "model" && value != "composite")
+					return false;
+				m_keyMode = (value == "model") ? MODELKEY : COMPOSITEKEY;
+			}
+			else if (arg.compare(0, 9, "--format=") == 0)
+				m_format = value;
+			else if (arg.compare(0, 6, "--out=") == 0)
+				m_out = value;
+			else
+				return false;
+		}
+		if (mixes.empty()) {
+			Mix readHeavy, churn;
+			parseMix("90:5:3:2", readHeavy);
+			parseMix("50:20:10:20", churn);
+			mixes.push_back(readHeavy);
+			mixes.push_back(churn);
+		}
+		m_mixes = mixes;
+		return m_format == "table" || m_format == "csv" || m_format == "json";
+	}
+
+	void run() {
+		for (int m = 0; m < m_models; m++)
+			m_modelNames.push_back("model" + to_string(m));
+		for (prob_t policy : m_policies)
+			for (long long size : m_sizes) {
+				runOne(policy, size);
+				if (m_threads > 0)
+					runSharded(policy, size);
+			}
+		report();
+	}
+
+private:
+	long long m_ops;
+	int m_models;
+	int m_batch;            // cars per insertBatch call in the load phase, 0 for single inserts
+	int m_threads;          // threads driving a ShardedCarDB, 0 to skip the sharded runs
+	int m_shards;           // shards of the ShardedCarDB, 0 for four per thread
+	long long m_background; // old slots per background migration step, 0 to migrate inline
+	long long m_budget;     // old slots each insert and remove migrates, 0 for increamental_Transfer
+	bool m_adaptive;        // setAdaptivePolicy on every table
+	long long m_journal;    // group commit interval in microseconds, -1 for no journal
+	keymode_t m_keyMode;
+	string m_format;
+	string m_out;
+	vector<long long> m_sizes;
+	vector<prob_t> m_policies;
+	vector<Mix> m_mixes;
+	vector<string> m_modelNames;
+	vector<Result> m_results;
+	mt19937 m_generator;
+
+	static bool parseMix(const string& text, Mix& mix) {
+		stringstream ss(text);
+		string item;
+		int total = 0;
+		for (int op = 0; op < NUM_OPS; op++) {
+			if (!getline(ss, item, ':'))
+				return false;
+			mix.weight[op] = atoi(item.c_str());
+			total += mix.weight[op];
+		}
+		mix.name = text;
+		return total > 0;
+	}
+
+	// the n-th key of a run; (model, dealer) pairs never repeat
+	Car makeCar(long long n) {
+		int dealer = MINID + static_cast<int>((n / m_models) % (MAXID - MINID + 1));
+		return Car(m_modelNames[n % m_models], static_cast<int>(n % 50) + 1, dealer, true);
+	}
+
+	void runOne(prob_t policy, long long size) {
+		CarDB db(MINPRIME, hashCode, policy, m_keyMode);
+		if (m_background > 0)
+			db.setBackgroundMigration(true, m_background);
+		db.setMigrationBudget(m_budget);
+		db.setAdaptivePolicy(m_adaptive);
+		if (m_journal >= 0)
+			db.openJournal(JOURNAL_FILE, chrono::microseconds(m_journal));
+		vector<Car> live;
+		long long nextKey = 0;
+		vector<long long> latency[NUM_OPS];
+		long long probes[NUM_OPS] = { 0 };
+
+		// load phase
+		live.reserve(size);
+		if (m_batch > 0) {
+			vector<Car> chunk;
+			for (long long n = 0; n < size; n += m_batch) {
+				chunk.clear();
+				for (long long k = n; k < min(size, n + m_batch); k++)
+					chunk.push_back(makeCar(nextKey++));
+				long long before = db.m_probeCount;
+				auto start = chrono::steady_clock::now();
+				db.insertBatch(chunk.data(), chunk.size());
+				auto stop = chrono::steady_clock::now();
+				probes[OP_INSERT] += db.m_probeCount - before;
+				long long perCar = chrono::duration_cast<chrono::nanoseconds>(stop - start).count() / static_cast<long long>(chunk.size());
+				for (const Car& car : chunk) {
+					latency[OP_INSERT].push_back(perCar);
+					live.push_back(car);
+				}
+			}
+			record(policy, size, "load", OP_INSERT_BATCH, latency[OP_INSERT], probes[OP_INSERT], db);
+		}
+		else {
+			for (long long n = 0; n < size; n++) {
+				Car car = makeCar(nextKey++);
+				long long before = db.m_probeCount;
+				auto start = chrono::steady_clock::now();
+				bool inserted = db.insert(car);
+				auto stop = chrono::steady_clock::now();
+				probes[OP_INSERT] += db.m_probeCount - before;
+				latency[OP_INSERT].push_back(chrono::duration_cast<chrono::nanoseconds>(stop - start).count());
+				if (inserted)
+					live.push_back(car);
+			}
+			record(policy, size, "load", OP_INSERT, latency[OP_INSERT], probes[OP_INSERT], db);
+		}
+
+		// mixed phases, each one starts from the state the previous one left
+		for (const Mix& mix : m_mixes) {
+			int total = 0;
+			for (int op = 0; op < NUM_OPS; op++) {
+				latency[op].clear();
+				probes[op] = 0;
+				total += mix.weight[op];
+			}
+			uniform_int_distribution<int> pick(0, total - 1);
+			for (long long n = 0; n < m_ops; n++) {
+				int roll = pick(m_generator);
+				int op = 0;
+				while (roll >= mix.weight[op])
+					roll -= mix.weight[op++];
+				if (live.empty() && op != OP_INSERT)
+					op = OP_INSERT;
+				size_t victim = uniform_int_distribution<size_t>(0, live.empty() ? 0 : live.size() - 1)(m_generator);
+				Car car = (op == OP_INSERT) ? makeCar(nextKey++) : live[victim];
+
+				long long before = db.m_probeCount;
+				auto start = chrono::steady_clock::now();
+				bool ok = false;
+				if (op == OP_READ)
+					ok = db.findCar(car.getModel(), car.getDealer()) != nullptr;
+				else if (op == OP_INSERT)
+					ok = db.insert(car);
+				else if (op == OP_UPDATE)
+					ok = db.updateQuantity(car, car.getQuantity() + 1);
+				else
+					ok = db.remove(car);
+				auto stop = chrono::steady_clock::now();
+				probes[op] += db.m_probeCount - before;
+				latency[op].push_back(chrono::duration_cast<chrono::nanoseconds>(stop - start).count());
+
+				if (op == OP_INSERT && ok)
+					live.push_back(car);
+				else if (op == OP_REMOVE && ok) {
+					live[victim] = live.back();
+					live.pop_back();
+				}
+			}
+			for (int op = 0; op < NUM_OPS; op++)
+				if (!latency[op].empty())
+					record(policy, size, mix.name, static_cast<op_t>(op), latency[op], probes[op], db);
+		}
+		db.closeJournal();
+		if (m_journal >= 0)
+			std::remove(JOURNAL_FILE);
+	}
+
+	// every thread loads its share of the cars and then runs each mix on its own keys,
+	// so the threads only meet on the shard locks
+	void runSharded(prob_t policy, long long size) {
+		int shards = (m_shards > 0) ? m_shards : 4 * m_threads;
+		ShardedCarDB db(shards, MINPRIME, hashCode, policy, m_keyMode);
+		string name = policyName(policy) + "/" + to_string(m_threads) + "T";
+		vector<vector<Car>> live(m_threads);
+		vector<vector<long long>> latency(m_threads);
+
+		runThreads([&](int t) {
+			for (long long n = t; n < size; n += m_threads) {
+				Car car = makeCar(n);
+				auto start = chrono::steady_clock::now();
+				bool inserted = db.insert(car);
+				auto stop = chrono::steady_clock::now();
+				latency[t].push_back(chrono::duration_cast<chrono::nanoseconds>(stop - start).count());
+				if (inserted)
+					live[t].push_back(car);
+			}
+		});
+		recordThreads(name, size, "load", "insert", latency, db);
+
+		long long nextKey = size;
+		for (const Mix& mix : m_mixes) {
+			int total = 0;
+			for (int op = 0; op < NUM_OPS; op++)
+				total += mix.weight[op];
+			for (vector<long long>& samples : latency)
+				samples.clear();
+			runThreads([&](int t) {
+				mt19937 generator(10 + t);
+				uniform_int_distribution<int> pick(0, total - 1);
+				long long key = nextKey + t;
+				for (long long n = t; n < m_ops; n += m_threads) {
+					int roll = pick(generator);
+					int op = 0;
+					while (roll >= mix.weight[op])
+						roll -= mix.weight[op++];
+					if (live[t].empty() && op != OP_INSERT)
+						op = OP_INSERT;
+					size_t victim = uniform_int_distribution<size_t>(0, live[t].empty() ? 0 : live[t].size() - 1)(generator);
+					Car car = (op == OP_INSERT) ? makeCar(key) : live[t][victim];
+					if (op == OP_INSERT)
+						key += m_threads;
+
+					auto start = chrono::steady_clock::now();
+					bool ok = false;
+					if (op == OP_READ)
+						ok = db.getCar(car.getModel(), car.getDealer()).getUsed();
+					else if (op == OP_INSERT)
+						ok = db.insert(car);
+					else if (op == OP_UPDATE)
+						ok = db.updateQuantity(car, car.getQuantity() + 1);
+					else
+						ok = db.remove(car);
+					auto stop = chrono::steady_clock::now();
+					latency[t].push_back(chrono::duration_cast<chrono::nanoseconds>(stop - start).count());
+
+					if (op == OP_INSERT && ok)
+						live[t].push_back(car);
+					else if (op == OP_REMOVE && ok) {
+						live[t][victim] = live[t].back();
+						live[t].pop_back();
+					}
+				}
+			});
+			nextKey += m_ops;
+			recordThreads(name, size, mix.name, "mixed", latency, db);
+		}
+	}
+
+	template <class Body>
+	void runThreads(Body body) {
+		vector<thread> threads;
+		for (int t = 0; t < m_threads; t++)
+			threads.push_back(thread(body, t));
+		for (thread& th : threads)
+			th.join();
+	}
+
+	// the samples of all threads as one row; ops/sec is the total, measured by the
+	// slowest thread
+	void recordThreads(const string& name, long long size, const string& phase, const string& op,
+		vector<vector<long long>>& latency, const ShardedCarDB& db) {
+		Result r;
+		vector<long long> samples;
+		long long slowestNs = 0;
+		for (const vector<long long>& thread : latency) {
+			long long totalNs = 0;
+			for (long long ns : thread)
+				totalNs += ns;
+			slowestNs = max(slowestNs, totalNs);
+			samples.insert(samples.end(), thread.begin(), thread.end());
+		}
+		long long probes = 0, capacity = 0;
+		for (int s = 0; s < db.shardCount(); s++) {
+			probes += db.m_shards[s]->m_db.m_probeCount;
+			capacity += db.m_shards[s]->m_db.m_currentCap;
+		}
+		r.policy = name;
+		r.size = size;
+		r.phase = phase;
+		r.op = op;
+		r.count = samples.size();
+		r.seconds = slowestNs / 1e9;
+		r.opsPerSec = (slowestNs > 0) ? r.count / r.seconds : 0.0;
+		r.avgProbes = static_cast<double>(probes) / max<long long>(1, r.count);
+		r.p50 = percentile(samples, 0.50);
+		r.p99 = percentile(samples, 0.99);
+		r.p999 = percentile(samples, 0.999);
+		r.max = percentile(samples, 1.0);
+		r.finalCap = capacity;
+		r.lambda = db.lambda();
+		m_results.push_back(r);
+	}
+
+	static string policyName(prob_t policy) {
+		return (policy == QUADRATIC) ? "QUADRATIC" : (policy == DOUBLEHASH) ? "DOUBLEHASH" : (policy == GROUPPROBE) ? "GROUPPROBE" : "ROBINHOOD";
+	}
+
+	static long long percentile(vector<long long>& samples, double p) {
+		size_t rank = static_cast<size_t>(p * (samples.size() - 1));
+		nth_element(samples.begin(), samples.begin() + rank, samples.end());
+		return samples[rank];
+	}
+
+	void record(prob_t policy, long long size, const string& phase, op_t op,
+		vector<long long>& samples, long long probes, const CarDB& db) {
+		Result r;
+		long long totalNs = 0;
+		for (long long ns : samples)
+			totalNs += ns;
+		r.policy = policyName(policy);
+		r.size = size;
+		r.phase = phase;
+		r.op = OP_NAMES[op];
+		r.count = samples.size();
+		r.seconds = totalNs / 1e9;
+		r.opsPerSec = (totalNs > 0) ? r.count / r.seconds : 0.0;
+		r.avgProbes = static_cast<double>(probes) / r.count;
+		r.p50 = percentile(samples, 0.50);
+		r.p99 = percentile(samples, 0.99);
+		r.p999 = percentile(samples, 0.999);
+		r.max = percentile(samples, 1.0);
+		r.finalCap = db.m_currentCap;
+		r.lambda = db.lambda();
+		m_results.push_back(r);
+	}
+
+	void report() {
+		ofstream file;
+		if (!m_out.empty())
+			file.open(m_out.c_str());
+		ostream& out = m_out.empty() ? cout : file;
+
+		if (m_format == "csv") {
+			out << "policy,size,phase,op,count,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns,max_ns,avg_probes,capacity,lambda\n";
+			for (const Result& r : m_results)
+				out << r.policy << ',' << r.size << ',' << r.phase << ',' << r.op << ',' << r.count << ','
+				<< r.seconds << ',' << r.opsPerSec << ',' << r.p50 << ',' << r.p99 << ',' << r.p999 << ',' << r.max << ','
+				<< r.avgProbes << ',' << r.finalCap << ',' << r.lambda << '\n';
+		}
+		else if (m_format == "json") {
+			out << "[\n";
+			for (size_t i = 0; i < m_results.size(); i++) {
+				const Result& r = m_results[i];
+				out << "  {\"policy\":\"" << r.policy << "\",\"size\":" << r.size << ",\"phase\":\"" << r.phase
+					<< "\",\"op\":\"" << r.op << "\",\"count\":" << r.count << ",\"seconds\":" << r.seconds
+					<< ",\"ops_per_sec\":" << r.opsPerSec << ",\"p50_ns\":" << r.p50 << ",\"p99_ns\":" << r.p99
+					<< ",\"p999_ns\":" << r.p999 << ",\"max_ns\":" << r.max << ",\"avg_probes\":" << r.avgProbes << ",\"capacity\":" << r.finalCap
+					<< ",\"lambda\":" << r.lambda << "}" << (i + 1 < m_results.size() ? "," : "") << "\n";
+			}
+			out << "]\n";
+		}
+		else {
+			out << left << setw(15) << "policy" << setw(9) << "size" << setw(13) << "phase" << setw(15) << "op"
+				<< right << setw(9) << "count" << setw(13) << "ops/sec" << setw(10) << "p50 ns" << setw(10) << "p99 ns"
+				<< setw(11) << "p999 ns" << setw(12) << "max ns" << setw(12) << "probes" << "\n";
+			for (const Result& r : m_results)
+				out << left << setw(15) << r.policy << setw(9) << r.size << setw(13) << r.phase << setw(15) << r.op
+				<< right << setw(9) << r.count << setw(13) << fixed << setprecision(0) << r.opsPerSec
+				<< setw(10) << r.p50 << setw(10) << r.p99 << setw(11) << r.p999 << setw(12) << r.max
+				<< setw(12) << setprecision(2) << r.avgProbes << "\n";
+		}
+	}
+};
+
+int main(int argc, char** argv) {
+	Bench bench;
+	if (!bench.parseArgs(argc, argv)) {
+		cerr << "usage: " << argv[0] << " [--sizes=101,1009,...] [--ops=N] [--mix=R:I:U:D] [--models=K]"
+			<< " [--policy=quadratic|doublehash|group|robinhood|all] [--keymode=model|composite] [--batch=N] [--threads=T] [--shards=N] [--background=B] [--budget=S] [--adaptive] [--journal=MICROS] [--format=table|csv|json] [--out=file]" << endl;
+		return 1;
+	}
+	bench.run();
+	return 0;
+}
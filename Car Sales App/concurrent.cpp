@@ -0,0 +1,97 @@
+// CMSC 341 - Fall 2023 - Project 4
+#include <functional>
+#include <thread>
+#include "concurrent.h"
+
+EpochDomain::EpochDomain() : m_epoch(1) {
+	for (Reader& reader : m_readers)
+		reader.m_epoch.store(0, memory_order_relaxed);
+}
+
+EpochDomain::~EpochDomain() {
+	for (const Retired& retired : m_retired)
+		retired.m_release(retired.m_memory);
+}
+
+EpochDomain::Guard::Guard(const EpochDomain& domain) {
+	// every thread starts looking at its own slot, so pinned readers rarely collide
+	static thread_local size_t hint = hash<thread::id>()(this_thread::get_id());
+	for (size_t i = hint;; i++) {
+		atomic<uint64_t>& slot = domain.m_readers[i % MAX_READERS].m_epoch;
+		uint64_t free = 0;
+		// an epoch read before the exchange may be stale, which only makes the pin stricter
+		if (slot.compare_exchange_strong(free, domain.m_epoch.load(memory_order_seq_cst), memory_order_seq_cst)) {
+			hint = i % MAX_READERS;
+			m_slot = &slot;
+			return;
+		}
+	}
+}
+
+void EpochDomain::retire(void* memory, void (*release)(void*)) {
+	Retired retired = { memory, release, m_epoch.fetch_add(1, memory_order_seq_cst) };
+	m_retired.push_back(retired);
+}
+
+void EpochDomain::collect() {
+	uint64_t oldest = UINT64_MAX;
+	for (const Reader& reader : m_readers) {
+		uint64_t epoch = reader.m_epoch.load(memory_order_seq_cst);
+		if (epoch != 0 && epoch < oldest)
+			oldest = epoch;
+	}
+	size_t kept = 0;
+	for (size_t i = 0; i < m_retired.size(); i++) {
+		if (m_retired[i].m_epoch < oldest)
+			m_retired[i].m_release(m_retired[i].m_memory);
+		else
+			m_retired[kept++] = m_retired[i];
+	}
+	m_retired.resize(kept);
+}
+
+WorkerPool::WorkerPool(int workers) : m_body(nullptr), m_job(0), m_running(0), m_stop(false) {
+	for (int worker = 1; worker < workers; worker++)
+		m_threads.emplace_back(&WorkerPool::loop, this, worker);
+}
+
+WorkerPool::~WorkerPool() {
+	{
+		lock_guard<mutex> lock(m_lock);
+		m_stop = true;
+	}
+	m_wake.notify_all();
+	for (thread& worker : m_threads)
+		worker.join();
+}
+
+void WorkerPool::run(const function<void(int worker)>& body) {
+	{
+		lock_guard<mutex> lock(m_lock);
+		m_body = &body;
+		m_running = static_cast<int>(m_threads.size());
+		m_job++;
+	}
+	m_wake.notify_all();
+	body(0);
+	unique_lock<mutex> lock(m_lock);
+	m_done.wait(lock, [this]() { return m_running == 0; });
+	m_body = nullptr;
+}
+
+void WorkerPool::loop(int worker) {
+	uint64_t seen = 0;
+	unique_lock<mutex> lock(m_lock);
+	for (;;) {
+		m_wake.wait(lock, [&]() { return m_stop || m_job != seen; });
+		if (m_stop)
+			return;
+		seen = m_job;
+		const function<void(int)>& body = *m_body;
+		lock.unlock();
+		body(worker);
+		lock.lock();
+		if (--m_running == 0)
+			m_done.notify_one();
+	}
+}
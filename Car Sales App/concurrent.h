@@ -0,0 +1,128 @@
+// CMSC 341 - Fall 2023 - Project 4
+#ifndef CONCURRENT_H
+#define CONCURRENT_H
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+// An append-only array whose elements never move. Element i lives in segment
+// floor(log2(i / BASE + 1)), each segment twice the size of the previous one, so
+// growing allocates a segment and copies nothing. One thread appends; other threads
+// may read any element whose index was handed to them after it was appended.
+template <class T>
+class SegmentedArray {
+public:
+	SegmentedArray() : m_size(0) {
+		for (atomic<T*>& segment : m_segments)
+			segment.store(nullptr, memory_order_relaxed);
+	}
+	~SegmentedArray() {
+		for (atomic<T*>& segment : m_segments)
+			delete[] segment.load(memory_order_relaxed);
+	}
+	SegmentedArray(const SegmentedArray&) = delete;
+	SegmentedArray& operator=(const SegmentedArray&) = delete;
+
+	const T& operator[](size_t i) const {
+		size_t k = segmentOf(i);
+		return m_segments[k].load(memory_order_acquire)[i - segmentStart(k)];
+	}
+	T& operator[](size_t i) {
+		size_t k = segmentOf(i);
+		return m_segments[k].load(memory_order_acquire)[i - segmentStart(k)];
+	}
+	void push_back(T value) {
+		size_t i = m_size.load(memory_order_relaxed);
+		size_t k = segmentOf(i);
+		T* segment = m_segments[k].load(memory_order_relaxed);
+		if (segment == nullptr) {
+			segment = new T[BASE << k];
+			m_segments[k].store(segment, memory_order_release);
+		}
+		segment[i - segmentStart(k)] = std::move(value);
+		m_size.store(i + 1, memory_order_release);
+	}
+	size_t size() const { return m_size.load(memory_order_acquire); }
+private:
+	static const size_t BASE = 16;          // size of the first segment
+	static const int MAX_SEGMENTS = 48;     // enough for any 64-bit index
+	static size_t segmentOf(size_t i) { return 63 - __builtin_clzll(i / BASE + 1); }
+	static size_t segmentStart(size_t k) { return BASE * ((static_cast<size_t>(1) << k) - 1); }
+
+	atomic<T*> m_segments[MAX_SEGMENTS];
+	atomic<size_t> m_size;
+};
+
+// Epoch-based reclamation for one writer and any number of readers. A reader pins the
+// domain for the length of one lookup by publishing the global epoch in a reader slot.
+// The writer unlinks memory first and retires it second; retire tags the memory with
+// the epoch and advances it. Memory is freed once every pinned reader has published a
+// later epoch, since such a reader started after the unlink and cannot reach it.
+class EpochDomain {
+public:
+	EpochDomain();
+	~EpochDomain();	// frees whatever is still retired, no reader may be pinned
+	EpochDomain(const EpochDomain&) = delete;
+	EpochDomain& operator=(const EpochDomain&) = delete;
+
+	// pins the domain for its lifetime
+	class Guard {
+	public:
+		explicit Guard(const EpochDomain& domain);
+		~Guard() { m_slot->store(0, memory_order_release); }
+		Guard(const Guard&) = delete;
+		Guard& operator=(const Guard&) = delete;
+	private:
+		atomic<uint64_t>* m_slot;
+	};
+
+	// writer only: hand over unlinked memory, freed later with release(memory)
+	void retire(void* memory, void (*release)(void*));
+	// writer only: free the retired memory no pinned reader can still reach
+	void collect();
+	size_t pending() const { return m_retired.size(); }
+private:
+	static const int MAX_READERS = 64;     // readers pinned at once, more wait for a slot
+	struct alignas(64) Reader {
+		atomic<uint64_t> m_epoch;           // the pinned epoch, 0 when the slot is free
+	};
+	struct Retired {
+		void* m_memory;
+		void (*m_release)(void*);
+		uint64_t m_epoch;
+	};
+	mutable Reader m_readers[MAX_READERS];
+	atomic<uint64_t> m_epoch;
+	vector<Retired> m_retired;
+};
+
+// A fixed set of threads that run one job at a time. run calls body(worker) once for
+// every worker from 0 to size() - 1, the calling thread being worker 0, and returns
+// once every call has returned. One thread calls run at a time.
+class WorkerPool {
+public:
+	explicit WorkerPool(int workers);
+	~WorkerPool();
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool& operator=(const WorkerPool&) = delete;
+	int size() const { return static_cast<int>(m_threads.size()) + 1; }
+	void run(const function<void(int worker)>& body);
+private:
+	mutex m_lock;
+	condition_variable m_wake;          // a job was posted, or the pool stops
+	condition_variable m_done;          // the last thread of a job finished
+	vector<thread> m_threads;
+	const function<void(int)>* m_body;
+	uint64_t m_job;                     // jobs posted so far
+	int m_running;                      // threads still in the current job
+	bool m_stop;
+
+	void loop(int worker);
+};
+#endif
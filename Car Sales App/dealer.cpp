@@ -1,107 +1,575 @@
 // CMSC 341 - Fall 2023 - Project 4
+#include <algorithm>
+#include <charconv>
+#include <climits>
+#include <cstdlib>
+#include <sstream>
+#include <sys/mman.h>
 #include "dealer.h"
-int CarDB::getCurrentCap() const { return m_currentCap; }
-CarDB::CarDB(int size, hash_fn hash, prob_t probing) {
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+// Table capacities grow along this ladder of primes, each about 1.2x the previous one.
+// The fast-division constant of every rung is computed by the compiler, so a rehash
+// neither searches for a prime nor divides to set up the modulus of the new table.
+// The ladder stops below 2^32 because the hash functions produce 32-bit values.
+static constexpr FastMod PRIME_LADDER[] = {
+	101ULL, 103ULL, 127ULL, 157ULL, 191ULL, 233ULL, 281ULL, 347ULL,
+	419ULL, 503ULL, 607ULL, 733ULL, 881ULL, 1061ULL, 1277ULL, 1543ULL,
+	1861ULL, 2237ULL, 2687ULL, 3229ULL, 3877ULL, 4657ULL, 5591ULL, 6719ULL,
+	8069ULL, 9689ULL, 11633ULL, 13963ULL, 16759ULL, 20113ULL, 24137ULL, 28979ULL,
+	34781ULL, 41759ULL, 50111ULL, 60139ULL, 72167ULL, 86627ULL, 103963ULL, 124759ULL,
+	149711ULL, 179657ULL, 215617ULL, 258743ULL, 310501ULL, 372607ULL, 447133ULL, 536561ULL,
+	643879ULL, 772657ULL, 927191ULL, 1112651ULL, 1335199ULL, 1602241ULL, 1922693ULL, 2307233ULL,
+	2768681ULL, 3322421ULL, 3986921ULL, 4784317ULL, 5741201ULL, 6889451ULL, 8267351ULL, 9920861ULL,
+	11905037ULL, 14286061ULL, 17143319ULL, 20571997ULL, 24686401ULL, 29623687ULL, 35548433ULL, 42658141ULL,
+	51189799ULL, 61427759ULL, 73713317ULL, 88456009ULL, 106147213ULL, 127376657ULL, 152852003ULL, 183422411ULL,
+	220106911ULL, 264128321ULL, 316954003ULL, 380344817ULL, 456413819ULL, 547696601ULL, 657235967ULL, 788683169ULL,
+	946419821ULL, 1135703791ULL, 1362844577ULL, 1635413509ULL, 1962496223ULL, 2354995469ULL, 2825994599ULL, 3391193537ULL,
+	4069432321ULL, 4294967291ULL
+};
+static const int PRIME_LADDER_SIZE = sizeof(PRIME_LADDER) / sizeof(PRIME_LADDER[0]);
+
+// Control bytes of the GROUPPROBE policy, one per slot. A full slot stores the
+// top 7 bits of its hash, so the high bit set means the slot is free.
+static const signed char CTRL_EMPTY = -128;    // never used, ends a probe
+static const signed char CTRL_DELETED = -2;    // tombstone, probes continue past it
+
+// Number of control bytes compared at once. The control array carries
+// GROUP_WIDTH - 1 extra bytes mirroring its head, so a group may start at any slot.
+#if defined(__AVX2__)
+static const int GROUP_WIDTH = 32;
+#else
+static const int GROUP_WIDTH = 16;
+#endif
+
+// bit i is set when byte i of the group equals value
+static inline uint32_t groupMatch(const signed char* group, signed char value) {
+#if defined(__AVX2__)
+	__m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(group));
+	return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(value))));
+#elif defined(__SSE2__)
+	__m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+	return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(value))));
+#else
+	uint32_t mask = 0;
+	for (int i = 0; i < GROUP_WIDTH; i++)
+		if (group[i] == value)
+			mask |= 1u << i;
+	return mask;
+#endif
+}
+
+// bit i is set when slot i of the group is empty or deleted
+static inline uint32_t groupMatchFree(const signed char* group) {
+#if defined(__AVX2__)
+	return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(group))));
+#elif defined(__SSE2__)
+	return static_cast<uint32_t>(_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(group))));
+#else
+	uint32_t mask = 0;
+	for (int i = 0; i < GROUP_WIDTH; i++)
+		if (group[i] < 0)
+			mask |= 1u << i;
+	return mask;
+#endif
+}
+
+// Slots per chunk of a parallel scan, a whole number of 64-slot occupancy blocks
+static const long long SCAN_CHUNK = 4096;
+
+// Smallest per-operation migration budget; see Currenttable_to_oldtable
+static const long long MIN_STEP_BUDGET = 8;
+
+// Operations per adaptive policy window; see adapt
+static const long long ADAPT_WINDOW = 1024;
+
+// How many keys ahead of the probe loop the batch calls prefetch home buckets
+static const size_t BATCH_PREFETCH = 8;
+
+static inline signed char hashTag(unsigned int hash) { return static_cast<signed char>(hash >> 25); }
+
+long long CarDB::getCurrentCap() const { return m_currentCap; }
+CarDB::CarDB(int size, hash_fn hash, prob_t probing, keymode_t keyMode) {
 	m_hash = hash;
+	m_keyHash = nullptr;
+	m_keyMode = keyMode;
+	init(size, probing);
+}
+
+CarDB::CarDB(int size, key_hash_fn hash, prob_t probing) {
+	m_hash = nullptr;
+	m_keyHash = hash;
+	m_keyMode = COMPOSITEKEY;
+	init(size, probing);
+}
+
+void CarDB::init(int size, prob_t probing) {
 	m_newPolicy = NONE;
+	m_reserved = 0;
+	m_resizePending = false;
 
-	// Set the current table size within the range [MINPRIME-MAXPRIME]
-	m_currentCap = findNextPrime(size);
-	m_currentTable = new Car[m_currentCap]();
+	// Set the current table size to the first rung of the prime ladder above size
+	m_currentMod = capacityFor(size);
+	m_currentCap = m_currentMod.m_divisor;
+	m_currentTable = newTable(m_currentCap);
 	m_currentSize = 0;
 	m_currNumDeleted = 0;
 	m_currProbing = probing;
+	m_currentCtrl = newCtrl(m_currentCap, m_currProbing);
 
 	// Initialize old table variables
 	m_oldTable = nullptr;
+	m_oldCtrl = nullptr;
 	m_oldCap = 0;
+	m_oldMod = FastMod();
 	m_oldSize = 0;
 	m_oldNumDeleted = 0;
 	m_oldProbing = NONE;
+
+	m_modelHashes.push_back(0);
+	m_probeCount = 0;
+	m_adaptive = false;
+	m_maxAvgProbes = 0;
+	m_maxProbes = 0;
+	m_windowOps = m_windowProbes = m_windowMax = 0;
+	m_windowMigrating = false;
+	m_adaptFrom = NONE;
+	m_adaptBaseline = 0;
+	m_adaptRejected = 0;
+	m_equalHashes = false;
+	for (int op = 0; op < NUM_STAT_OPS; op++) {
+		m_opCount[op] = m_opProbes[op] = 0;
+		for (int bucket = 0; bucket < PROBE_BUCKETS; bucket++)
+			m_probeHist[op][bucket] = 0;
+	}
+	m_oldLookups = m_oldHits = 0;
+	m_migratedCars = 0;
+	m_rehashes = 0;
+
+	m_concurrentReads = false;
+	m_background = false;
+	m_stopWorker = false;
+	m_migrationBudget = 1024;
+	m_stepBudget = 0;
+	m_migrationPause = chrono::microseconds(0);
+	m_oldCursor = 0;
+	m_oldLive = 0;
+	m_mappedTable = nullptr;
+	m_mappedLength = 0;
+	m_moveSeq = 0;
+	m_readView = nullptr;
+	publishTables();
 }
 
 CarDB::~CarDB() {
-	delete[] m_currentTable;
-	delete[] m_oldTable;
+	setBackgroundMigration(false);
+	releaseTable(m_currentTable);
+	releaseTable(m_oldTable);
+	delete[] m_currentCtrl;
+	delete[] m_oldCtrl;
+	delete m_readView.load();
 }
 
 void CarDB::changeProbPolicy(prob_t policy) {
+	unique_lock<recursive_mutex> lock = writerLock();
+	if (policy == NONE)
+		return;
+	if (policy == m_currProbing) {
+		m_newPolicy = NONE;	// withdraws a change that has not started yet
+		return;
+	}
 	m_newPolicy = policy;
+	// the new policy takes effect through a rehash, now or once the running one ends
+	if (m_oldTable == NULL) {
+		Currenttable_to_oldtable();
+		continueMigration();
+	}
 }
 
-bool CarDB::insert(Car car) {
-	// Hash the car model to get the index
+void CarDB::reserve(long long n) {
+	unique_lock<recursive_mutex> lock = writerLock();
+	m_reserved = max(n, 0LL);
+	// below half the capacity the growth rule leaves the table alone
+	if (m_reserved * 2 < m_currentCap)
+		return;
+	if (m_oldTable == NULL) {
+		Currenttable_to_oldtable();
+		continueMigration();
+	}
+	else
+		m_resizePending = true;
+}
+
+void CarDB::shrink_to_fit() {
+	unique_lock<recursive_mutex> lock = writerLock();
+	m_reserved = 0;
+	if (capacityFor((m_currentSize - m_currNumDeleted) * 4).m_divisor >= static_cast<uint64_t>(m_currentCap))
+		return;
+	if (m_oldTable == NULL) {
+		Currenttable_to_oldtable();
+		continueMigration();
+	}
+	else
+		m_resizePending = true;
+}
+
+void CarDB::setAdaptivePolicy(bool enabled, double maxAvgProbes, long long maxProbes) {
+	unique_lock<recursive_mutex> lock = writerLock();
+	m_adaptive = enabled;
+	m_maxAvgProbes = maxAvgProbes;
+	m_maxProbes = maxProbes;
+	m_windowOps = m_windowProbes = m_windowMax = 0;
+	m_windowMigrating = false;
+	m_adaptFrom = NONE;
+	m_adaptRejected = 0;
+	m_equalHashes = false;
+}
+
+void CarDB::record(statop_t op, long long probesBefore) const {
+	long long probes = m_probeCount - probesBefore;
+	m_opCount[op]++;
+	m_opProbes[op] += probes;
+	int bucket = (probes == 0) ? 0 : 64 - __builtin_clzll(static_cast<unsigned long long>(probes));
+	m_probeHist[op][min(bucket, PROBE_BUCKETS - 1)]++;
+	if (!m_adaptive)
+		return;
+	m_windowOps++;
+	m_windowProbes += probes;
+	m_windowMax = max(m_windowMax, probes);
+	if (m_oldTable != NULL)
+		m_windowMigrating = true;
+}
+
+void CarDB::adapt() {
+	if (!m_adaptive || m_windowOps < ADAPT_WINDOW)
+		return;
+	double average = static_cast<double>(m_windowProbes) / m_windowOps;
+	bool degraded = average > m_maxAvgProbes || m_windowMax > m_maxProbes;
+	bool migrated = m_windowMigrating;
+	m_windowOps = m_windowProbes = m_windowMax = 0;
+	m_windowMigrating = false;
+	// a migration in progress already rebuilds the table, judge it once it is done
+	if (m_oldTable != NULL || m_newPolicy != NONE)
+		return;
+	if (m_adaptFrom != NONE) {
+		// the first window wholly on the new table judges the change
+		if (migrated)
+			return;
+		prob_t from = m_adaptFrom;
+		m_adaptFrom = NONE;
+		if (average >= m_adaptBaseline) {
+			m_adaptRejected |= 1u << m_currProbing;
+			changeProbPolicy(from);
+		}
+		return;
+	}
+	if (!degraded)
+		return;
+	if (m_currNumDeleted * 4 > m_currentSize) {
+		Currenttable_to_oldtable();	// many tombstones, a rehash of the same policy clears them
+		continueMigration();
+		return;
+	}
+	// cars of one hash share every probe sequence, whatever the policy
+	m_equalHashes = equalHashes();
+	if (m_equalHashes)
+		return;
+	prob_t next = NONE;
+	if (m_currProbing == QUADRATIC)
+		next = DOUBLEHASH;	// keys sharing a home slot share a quadratic sequence too
+	else if (m_currProbing == DOUBLEHASH)
+		next = GROUPPROBE;	// linear groups compare 16 tags per probe
+	if (next == NONE || (m_adaptRejected & (1u << next)) != 0)
+		return;
+	m_adaptFrom = m_currProbing;
+	m_adaptBaseline = average;
+	changeProbPolicy(next);
+}
+
+bool CarDB::equalHashes() const {
+	// the first live cars of the table are sample enough, equal hashes come in crowds
+	const long long SAMPLE = 256;
+	vector<unsigned int> hashes;
+	for (long long i = 0; i < m_currentCap && static_cast<long long>(hashes.size()) < SAMPLE; i++) {
+		if (m_currentTable[i].getUsed())
+			hashes.push_back(m_currentTable[i].m_hashCode);
+	}
+	sort(hashes.begin(), hashes.end());
+	size_t shared = 0;
+	for (size_t i = 0; i < hashes.size(); i++) {
+		if ((i > 0 && hashes[i] == hashes[i - 1]) || (i + 1 < hashes.size() && hashes[i] == hashes[i + 1]))
+			shared++;
+	}
+	return shared * 2 > hashes.size();
+}
+
+bool CarDB::insert(const Car& car) {
+	unique_lock<recursive_mutex> lock = writerLock();
+	if (car == EMPTY)
+		return 0;
+	return insertKey(internModel(string_view(car.m_model)), car.m_dealer, car.m_quantity);
+}
+
+bool CarDB::insert(Car&& car) {
+	unique_lock<recursive_mutex> lock = writerLock();
 	if (car == EMPTY)
 		return 0;
-	int index = m_hash(car.getModel()) % m_currentCap;
-	int i = 0;
+	return insertKey(internModel(std::move(car.m_model)), car.m_dealer, car.m_quantity);
+}
+
+bool CarDB::emplace(string_view model, int quantity, int dealer) {
+	unique_lock<recursive_mutex> lock = writerLock();
+	if (model.empty() && dealer == 0)
+		return 0;
+	return insertKey(internModel(model), dealer, quantity);
+}
+
+bool CarDB::insertKey(uint32_t modelId, int dealer, int quantity) {
+	// Hash the car model to get the index
+	long long before = m_probeCount;
+	bool placed = placeCar(modelId, dealer, quantity, hashKey(modelId, dealer));
+	record(STAT_INSERT, before);
+	if (!placed)
+		return false; // Car already exists, cannot insert duplicates
+	journal(JOURNAL_INSERT, modelId, dealer, quantity);
+
+	//Check for rehashing criteria, a pending policy change or resize starts as soon as it can
+	if ((lambda() > 0.5 || m_newPolicy != NONE || m_resizePending) && m_oldTable == NULL)
+		Currenttable_to_oldtable();
+	else if (lambda() > 0.5 && (m_background || m_stepBudget > 0)) {
+		// the migration fell behind; every insert past half full helps it with a share of
+		// the old slots left, enough to finish before three quarters full, and the next
+		// rehash starts once the old table is gone
+		long long headroom = max(1LL, static_cast<long long>(0.75 * m_currentCap) - m_currentSize - m_currNumDeleted);
+		long long budget = max(max(m_stepBudget, MIN_STEP_BUDGET), (m_oldCap - m_oldCursor) / headroom + 1);
+		if (!migrateStep(budget))
+			Currenttable_to_oldtable();
+	}
+
+	if (m_oldTable != NULL) 	//if true, mean increamental transfer is still in progress,
+		continueMigration();
+
+	adapt();
+	return true;
+}
+
+bool CarDB::placeCar(uint32_t modelId, int dealer, int quantity, unsigned int hash) {
+	long long index = m_currentMod.mod(hash);
+	long long i = 0;
+	if (m_currProbing == ROBINHOOD) {
+		if (robinFind(m_currentTable, m_currentMod, hash, modelId, dealer) >= 0)
+			return false;
+		robinPlace(modelId, dealer, quantity, hash);
+		m_currentSize++;
+		trackInsert(modelId, dealer, quantity, hash);
+		return true;
+	}
+	if (m_currProbing == GROUPPROBE) {
+		if (groupFind(m_currentTable, m_currentCtrl, m_currentMod, hash, modelId, dealer) >= 0)
+			return false;
+		index = groupClaim(m_currentCtrl, m_currentMod, hash);
+	}
 	// Handle collisions using the current probing policy
-	while (m_currentTable[index].getUsed()) {
-		if (m_currentTable[index] == car) 
-			return false; // Car already exists, cannot insert duplicates
-		
+	else while (m_currentTable[index].getUsed()) {
+		if (holds(m_currentTable[index], modelId, dealer))
+			return false;
 
 		// Use quadratic or double-hash probing based on the policy
-		if (m_currProbing == QUADRATIC) 
-			index = (index + (i * i)) % m_currentCap;
-		else if (m_currProbing == DOUBLEHASH) 
-			index = (index + i * (11 - (m_hash(car.getModel()) % 11))) % m_currentCap;
-		
+		index = nextIndex(index, i, hash, m_currentMod, m_currProbing);
+		m_probeCount++;
 		i++;
 	}
 
-	m_currentTable[index] = car;
+	m_currentTable[index].store(modelId, dealer, quantity, hash, true);
 	m_currentSize++;
+	trackInsert(modelId, dealer, quantity, hash);
+	return true;
+}
 
-	//Check for rehashing criteria
-	if (lambda() > 0.5 && m_oldTable == NULL)
-		Currenttable_to_oldtable();
+size_t CarDB::insertBatch(const Car* cars, size_t count) {
+	unique_lock<recursive_mutex> lock = writerLock();
+	// Resolve every key before touching the table
+	vector<uint32_t> modelIds(count);
+	vector<unsigned int> hashes(count);
+	for (size_t k = 0; k < count; k++) {
+		modelIds[k] = (cars[k] == EMPTY) ? 0 : internModel(string_view(cars[k].m_model));
+		if (modelIds[k] != 0)
+			hashes[k] = hashKey(modelIds[k], cars[k].m_dealer);
+	}
 
-	if (m_oldTable != NULL) 	//if true, mean increamental transfer is still in progress,
-		increamental_Transfer();
+	// Size the current table for the whole batch up front, so no rehash starts inside it.
+	// The rehash is left to the migration mode like any other; the cars it moved aside
+	// were stored before the batch, so a row with one of their keys is a duplicate
+	long long live = m_currentSize - m_currNumDeleted;
+	bool rotated = false;
+	if ((m_currentSize + m_currNumDeleted + static_cast<long long>(count)) > 0.5 * m_currentCap) {
+		if (m_oldTable != NULL) {
+			// a rehash still runs and only one can: the rows go in one by one, each helping
+			// the migration as its mode allows
+			size_t inserted = 0;
+			for (size_t k = 0; k < count; k++)
+				if (modelIds[k] != 0 && insertKey(modelIds[k], cars[k].m_dealer, cars[k].m_quantity))
+					inserted++;
+			return inserted;
+		}
+		Currenttable_to_oldtable(live + static_cast<long long>(count));
+		rotated = true;
+	}
 
-	return true;
+	size_t inserted = 0;
+	for (size_t k = 0; k < count; k++) {
+		if (k + BATCH_PREFETCH < count && modelIds[k + BATCH_PREFETCH] != 0)
+			prefetchHome(m_currentTable, m_currentCtrl, m_currentMod, hashes[k + BATCH_PREFETCH]);
+		if (modelIds[k] == 0)
+			continue;
+		long long before = m_probeCount;
+		if (!(rotated && oldCopy(modelIds[k], cars[k].m_dealer, hashes[k]) != nullptr)
+			&& placeCar(modelIds[k], cars[k].m_dealer, cars[k].m_quantity, hashes[k])) {
+			journal(JOURNAL_INSERT, modelIds[k], cars[k].m_dealer, cars[k].m_quantity);
+			inserted++;
+		}
+		record(STAT_INSERT, before);
+	}
+
+	// One migration step for the whole batch
+	if (m_oldTable != NULL)
+		continueMigration(static_cast<long long>(count));
+	return inserted;
 }
 
-void CarDB::Currenttable_to_oldtable()
+size_t CarDB::getCars(const Car* keys, size_t count, Car* results) const {
+	unique_lock<recursive_mutex> lock = writerLock();
+	vector<uint32_t> modelIds(count);
+	vector<unsigned int> hashes(count);
+	for (size_t k = 0; k < count; k++) {
+		modelIds[k] = m_models.find(keys[k].m_model);
+		if (modelIds[k] != 0)
+			hashes[k] = hashKey(modelIds[k], keys[k].m_dealer);
+	}
+
+	size_t found = 0;
+	for (size_t k = 0; k < count; k++) {
+		if (k + BATCH_PREFETCH < count && modelIds[k + BATCH_PREFETCH] != 0)
+			prefetchHome(m_currentTable, m_currentCtrl, m_currentMod, hashes[k + BATCH_PREFETCH]);
+		const CarSlot* slot = nullptr;
+		if (modelIds[k] != 0) {
+			long long before = m_probeCount;
+			slot = locate(modelIds[k], keys[k].m_dealer, hashes[k]);
+			record(STAT_FIND, before);
+		}
+		if (slot != nullptr) {
+			results[k] = toCar(*slot);
+			found++;
+		}
+		else
+			results[k] = EMPTY;
+	}
+	return found;
+}
+
+size_t CarDB::updateQuantities(const Car* cars, const int* quantities, size_t count) {
+	unique_lock<recursive_mutex> lock = writerLock();
+	vector<uint32_t> modelIds(count);
+	vector<unsigned int> hashes(count);
+	for (size_t k = 0; k < count; k++) {
+		modelIds[k] = m_models.find(cars[k].m_model);
+		if (modelIds[k] != 0)
+			hashes[k] = hashKey(modelIds[k], cars[k].m_dealer);
+	}
+
+	size_t updated = 0;
+	for (size_t k = 0; k < count; k++) {
+		if (k + BATCH_PREFETCH < count && modelIds[k + BATCH_PREFETCH] != 0)
+			prefetchHome(m_currentTable, m_currentCtrl, m_currentMod, hashes[k + BATCH_PREFETCH]);
+		if (modelIds[k] == 0)
+			continue;
+		long long before = m_probeCount;
+		CarSlot* slot = locate(modelIds[k], cars[k].m_dealer, hashes[k]);
+		record(STAT_UPDATE, before);
+		if (slot != nullptr) {
+			setQuantity(slot, modelIds[k], quantities[k]);
+			updated++;
+		}
+	}
+	return updated;
+}
+
+void CarDB::prefetchHome(const CarSlot* table, const signed char* ctrl, const FastMod& cap, unsigned int hash) {
+	long long index = cap.mod(hash);
+	if (ctrl != nullptr)
+		__builtin_prefetch(ctrl + index);
+	__builtin_prefetch(table + index);
+}
+
+void CarDB::Currenttable_to_oldtable(long long minLive)
 {
 	m_oldTable = m_currentTable;
 	m_oldCap = m_currentCap;
+	m_oldMod = m_currentMod;
 	m_oldSize = m_currentSize;
 	m_oldNumDeleted = m_currNumDeleted;
 	m_oldProbing = m_currProbing;
+	m_oldCtrl = m_currentCtrl;
+	m_rehashes++;
+	m_resizePending = false;
+	if (m_newPolicy != NONE) {
+		m_currProbing = m_newPolicy;	// the new table is built with the requested policy
+		m_newPolicy = NONE;
+	}
 
-	m_currentCap = findNextPrime((m_currentSize - m_currNumDeleted) * 4);
+	long long target = max(max(m_currentSize - m_currNumDeleted, minLive) * 4, m_reserved * 2);
+	// with a step budget or the worker the table shrinks at most by half per rehash, so
+	// the next rehash is at least m_oldCap / 8 inserts away and the old table drains before it
+	if (m_stepBudget > 0 || m_background)
+		target = max(target, m_oldCap / 2);
+	m_currentMod = capacityFor(target);
+	m_currentCap = m_currentMod.m_divisor;
 	m_currentSize = 0;	m_currNumDeleted = 0;
-	m_currentTable = new Car[m_currentCap];
+	m_currentTable = newTable(m_currentCap);
+	m_currentCtrl = newCtrl(m_currentCap, m_currProbing);
+	m_oldCursor = 0;
+	m_oldLive = m_oldSize - m_oldNumDeleted;
+	publishTables();
 }
 
-bool CarDB::simple_insert(Car car)
+bool CarDB::simple_insert(const CarSlot& slot)
 {
-	if (car == EMPTY)
+	if (slot.m_modelId == 0)
 		return false;
-	// Hash the car model to get the index
-	int index = m_hash(car.getModel()) % m_currentCap;
-	int i = 0;
+	// The slot comes from the old table, its key hash is already known
+	unsigned int hash = slot.m_hashCode;
+	long long index = m_currentMod.mod(hash);
+	long long i = 0;
 
+	if (m_currProbing == ROBINHOOD) {
+		if (robinFind(m_currentTable, m_currentMod, hash, slot.m_modelId, slot.m_dealer) >= 0)
+			return false;
+		robinPlace(slot.m_modelId, slot.m_dealer, slot.m_quantity, hash);
+		m_currentSize++;
+		m_migratedCars++;
+		return true;
+	}
+	if (m_currProbing == GROUPPROBE) {
+		if (groupFind(m_currentTable, m_currentCtrl, m_currentMod, hash, slot.m_modelId, slot.m_dealer) >= 0)
+			return false; 			// Car already exists, cannot insert duplicates
+		index = groupClaim(m_currentCtrl, m_currentMod, hash);
+	}
 	// Handle collisions using the current probing policy
-	while (m_currentTable[index].getUsed()) {
-		if (m_currentTable[index] == car)
+	else while (m_currentTable[index].getUsed()) {
+		if (holds(m_currentTable[index], slot.m_modelId, slot.m_dealer))
 			return false; 			// Car already exists, cannot insert duplicates
 
 		// Use quadratic or double-hash probing based on the policy
-		if (m_currProbing == QUADRATIC)
-			index = (index + (i * i)) % m_currentCap;
-
-		else if (m_currProbing == DOUBLEHASH)
-			index = (index + i * (11 - (m_hash(car.getModel()) % 11))) % m_currentCap;
-
+		index = nextIndex(index, i, hash, m_currentMod, m_currProbing);
+		m_probeCount++;
 		i++;
 	}
 
 	// Insert the car at the calculated index
-	m_currentTable[index] = car;
+	m_currentTable[index].store(slot.m_modelId, slot.m_dealer, slot.m_quantity, slot.m_hashCode, true);
 	m_currentSize++;
+	m_migratedCars++;
 	return true;
 }
 
@@ -109,20 +577,22 @@ void CarDB::increamental_Transfer()
 {
 	if (m_oldNumDeleted == m_oldSize)
 	{
-		delete[] m_oldTable;
-		m_oldTable = nullptr;
-		m_oldCap = 0;
-		m_oldSize = 0;
-		m_oldNumDeleted = 0;
+		dropOldTable();
 		return;
 	}
-	int numToTransfer = static_cast<int>(floor(0.25 * m_oldSize));
+	// a reader whose lookup overlaps this step runs it again
+	m_moveSeq.store(m_moveSeq.load(memory_order_relaxed) + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	// at least one car per step, a quarter of a table of 1 to 3 cars would be none
+	long long numToTransfer = max(1LL, static_cast<long long>(floor(0.25 * m_oldSize)));
 	while (numToTransfer > 0 && m_oldSize > 0) {
-		for (int j = 0; j < m_oldCap && numToTransfer > 0; j++) {
-			if (m_oldTable[j].getUsed() && !m_oldTable[j].getModel().empty()) {
+		for (long long j = 0; j < m_oldCap && numToTransfer > 0; j++) {
+			if (m_oldTable[j].getUsed() && m_oldTable[j].m_modelId != 0) {
 				// Transfer live data and mark as deleted in the old table
 				simple_insert(m_oldTable[j]); //to avoid recursion
-				m_oldTable[j].setUsed(false);
+				m_oldTable[j].storeUsed(false);
+				if (m_oldCtrl != nullptr)
+					setCtrl(m_oldCtrl, m_oldCap, j, CTRL_DELETED);
 				m_oldNumDeleted++;
 				numToTransfer--;
 				if (m_oldNumDeleted == m_oldSize) break;
@@ -130,136 +600,345 @@ void CarDB::increamental_Transfer()
 		}
 		if (m_oldNumDeleted == m_oldSize) break;
 	}
+	m_moveSeq.store(m_moveSeq.load(memory_order_relaxed) + 1, memory_order_release);
 }
 
-bool CarDB::remove(Car car) {
-	// Implement the removal logic here
-	// Hash the car model to get the index
-	if (car == EMPTY)
+void CarDB::dropOldTable() {
+	CarSlot* table = m_oldTable;
+	signed char* ctrl = m_oldCtrl;
+	m_oldTable = nullptr;
+	m_oldCtrl = nullptr;
+	m_oldCap = 0;
+	m_oldMod = FastMod();
+	m_oldSize = 0;
+	m_oldNumDeleted = 0;
+	publishTables();
+	retireTable(table, ctrl);
+	m_migrationDone.notify_all();
+}
+
+bool CarDB::migrateStep(long long budget) {
+	if (m_oldTable == nullptr)
 		return false;
-	int index = m_hash(car.getModel()) % m_currentCap;
-	int i = 0;
+	m_moveSeq.store(m_moveSeq.load(memory_order_relaxed) + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	// the cursor only moves forward, no slot of the old table is looked at twice
+	for (; budget > 0 && m_oldCursor < m_oldCap; budget--, m_oldCursor++) {
+		CarSlot& slot = m_oldTable[m_oldCursor];
+		if (slot.getUsed() && slot.m_modelId != 0) {
+			simple_insert(slot);
+			slot.storeUsed(false);
+			if (m_oldCtrl != nullptr)
+				setCtrl(m_oldCtrl, m_oldCap, m_oldCursor, CTRL_DELETED);
+			m_oldNumDeleted++;
+		}
+	}
+	m_moveSeq.store(m_moveSeq.load(memory_order_relaxed) + 1, memory_order_release);
+	if (m_oldCursor == m_oldCap || m_oldNumDeleted == m_oldSize)
+		dropOldTable();
+	return m_oldTable != nullptr;
+}
 
-	// Handle collisions using the current probing policy
-	while (true) {
-		// Check if the current bucket contains the target car
-		if (m_currentTable[index] == car && m_currentTable[index].getUsed()) {
-			// Car found, mark as deleted
-			m_currentTable[index].setUsed(false);
-			m_currNumDeleted++;
+void CarDB::continueMigration(long long ops) {
+	if (m_background)
+		m_migrationWake.notify_one();
+	else if (m_stepBudget > 0)
+		migrateStep(m_stepBudget * ops);
+	else
+		increamental_Transfer();
+}
 
-			// Check for rehashing criteria
-			if (deletedRatio() > 0.8)
-				Currenttable_to_oldtable(); // Convert to oldtable
+void CarDB::setMigrationBudget(long long slots) {
+	unique_lock<recursive_mutex> lock = writerLock();
+	// below MIN_STEP_BUDGET an old table might outlive the next rehash
+	m_stepBudget = (slots <= 0) ? 0 : max(slots, MIN_STEP_BUDGET);
+}
 
-			if (m_oldTable != NULL)
-				increamental_Transfer(); // Continue incremental transfer
+void CarDB::setBackgroundMigration(bool enabled, long long budget, chrono::microseconds pause) {
+	{
+		unique_lock<recursive_mutex> lock(m_writeLock);
+		m_migrationBudget = max(1LL, budget);
+		m_migrationPause = pause;
+		if (enabled == m_background)
+			return;
+		m_stopWorker = !enabled;
+		if (enabled) {
+			m_background = true;
+			m_worker = thread(&CarDB::migrationWorker, this);
+			return;
+		}
+		m_migrationWake.notify_all();
+	}
+	m_worker.join();
+	m_background = false;
+}
 
-			return true;
+void CarDB::migrationWorker() {
+	unique_lock<recursive_mutex> lock(m_writeLock);
+	while (!m_stopWorker) {
+		if (m_oldTable == nullptr) {
+			m_migrationWake.wait(lock);
+			continue;
 		}
+		migrateStep(m_migrationBudget);
+		// the foreground gets the lock between two steps
+		chrono::microseconds pause = m_migrationPause;
+		lock.unlock();
+		if (pause.count() > 0)
+			this_thread::sleep_for(pause);
+		else
+			this_thread::yield();
+		lock.lock();
+	}
+}
 
-		// Move to the next bucket using the probing logic
-		if (m_currProbing == QUADRATIC)
-			index = (index + (i * i)) % m_currentCap;
-		else if (m_currProbing == DOUBLEHASH)
-			index = (index + i * (11 - (m_hash(car.getModel()) % 11))) % m_currentCap;
+void CarDB::waitForMigration() {
+	unique_lock<recursive_mutex> lock(m_writeLock);
+	if (!m_background) {
+		while (m_oldTable != nullptr)
+			increamental_Transfer();
+		return;
+	}
+	m_migrationWake.notify_one();
+	m_migrationDone.wait(lock, [this]() { return m_oldTable == nullptr; });
+}
 
-		// Check if we have iterated through all possible buckets
-		if (i >= m_currentCap)
-			break;
+double CarDB::migrationProgress() const {
+	unique_lock<recursive_mutex> lock = writerLock();
+	if (m_oldTable == nullptr || m_oldLive <= 0)
+		return 1.0;
+	return 1.0 - static_cast<double>(m_oldSize - m_oldNumDeleted) / m_oldLive;
+}
 
-		i++;
-	}
+unique_lock<recursive_mutex> CarDB::writerLock() const {
+	if (!m_background)
+		return unique_lock<recursive_mutex>();
+	return unique_lock<recursive_mutex>(m_writeLock);
+}
 
-	// Car not found
-	i = 0;
-	if (m_oldTable != NULL) {
-		while (true) {
-			// Check if the current bucket contains the target car
-			if (m_oldTable[index] == car && m_oldTable[index].getUsed()) {
-				// Car found, mark as deleted
-				m_oldTable[index].setUsed(false);
-				m_oldNumDeleted++;
+bool CarDB::remove(const Car& car) {
+	unique_lock<recursive_mutex> lock = writerLock();
+	// Implement the removal logic here
+	// Hash the car key to get the index
+	if (car == EMPTY)
+		return false;
+	uint32_t modelId = m_models.find(car.m_model);
+	if (modelId == 0)
+		return false; // no car of this model was ever stored
+	long long before = m_probeCount;
+	bool removed = removeKey(modelId, car.m_dealer);
+	record(STAT_REMOVE, before);
+	if (removed)
+		journal(JOURNAL_REMOVE, modelId, car.m_dealer, 0);
+	adapt();
+	return removed;
+}
 
-				return true;
-			}
+bool CarDB::removeKey(uint32_t modelId, int dealer) {
+	unsigned int hash = hashKey(modelId, dealer);
+
+	// Search the current table
+	long long index = scanFor(m_currentTable, m_currentCtrl, m_currentMod, m_currProbing, hash, modelId, dealer);
+	if (index >= 0) {
+		// Car found, mark as deleted
+		int quantity = m_currentTable[index].m_quantity;
+		if (m_currProbing == ROBINHOOD)
+			robinErase(index);	// no tombstone is left
+		else {
+			m_currentTable[index].storeUsed(false);
+			if (m_currentCtrl != nullptr)
+				setCtrl(m_currentCtrl, m_currentCap, index, CTRL_DELETED);
+			m_currNumDeleted++;
+		}
+		trackRemove(modelId, dealer, quantity, hash);
+
+		// Check for rehashing criteria; a rehash in progress has to finish first,
+		// or its old table would be overwritten with the cars still in it
+		if ((deletedRatio() > 0.8 || m_newPolicy != NONE || m_resizePending) && m_oldTable == NULL)
+			Currenttable_to_oldtable(); // Convert to oldtable
 
-			// Move to the next bucket using the probing logic
-			if (m_oldProbing == QUADRATIC)
-				index = (index + (i * i)) % m_oldCap;
-			else if (m_oldProbing == DOUBLEHASH)
-				index = (index + i * (11 - (m_hash(car.getModel()) % 11))) % m_oldCap;
+		if (m_oldTable != NULL)
+			continueMigration(); // Continue incremental transfer
 
-			// Check if we have iterated through all possible buckets
-			if (i >= m_oldCap)
-				break;
+		return true;
+	}
+
+	// Car not found
+	if (m_oldTable != NULL) {
+		index = scanFor(m_oldTable, m_oldCtrl, m_oldMod, m_oldProbing, hash, modelId, dealer);
+		if (index >= 0) {
+			// Car found, mark as deleted
+			m_oldTable[index].storeUsed(false);
+			if (m_oldCtrl != nullptr)
+				setCtrl(m_oldCtrl, m_oldCap, index, CTRL_DELETED);
+			m_oldNumDeleted++;
+			trackRemove(modelId, dealer, m_oldTable[index].m_quantity, hash);
 
-			i++;
+			return true;
 		}
 	}
 
 	return false; // Car not found
 }
 
-Car CarDB::getCar(string model, int dealer) const {
-	// Implement the search logic here
-	// Hash the car model to get the index
-	int index = m_hash(model) % m_currentCap;
-	int i = 0;
+Car CarDB::getCar(string_view model, int dealer) const {
+	if (m_concurrentReads)
+		return readCar(model, dealer);
+	unique_lock<recursive_mutex> lock = writerLock();
+	const CarSlot* slot = findCar(model, dealer);
+	return (slot != nullptr) ? toCar(*slot) : EMPTY;
+}
+
+const CarSlot* CarDB::findCar(string_view model, int dealer) const {
+	unique_lock<recursive_mutex> lock = writerLock();
+	// The model name is resolved once, the tables are searched by ID
+	uint32_t modelId = m_models.find(model);
+	if (modelId == 0)
+		return nullptr;
+	long long before = m_probeCount;
+	const CarSlot* slot = locate(modelId, dealer, hashKey(modelId, dealer));
+	record(STAT_FIND, before);
+	return slot;
+}
 
+CarSlot* CarDB::locate(uint32_t modelId, int dealer, unsigned int hash) const {
 	// Search in the current table
-	while (m_currentTable[index].getUsed()) {
-		if (m_currentTable[index].getModel() == model && m_currentTable[index].getDealer() == dealer) {
-			// Car found in the current table
-			return m_currentTable[index];
-		}
+	long long index = findIn(m_currentTable, m_currentCtrl, m_currentMod, m_currProbing, hash, modelId, dealer);
+	if (index >= 0)
+		return &m_currentTable[index];
 
-		// Use quadratic or double-hash probing based on the current probing policy
-		if (m_currProbing == QUADRATIC) {
-			index = (index + (i * i)) % m_currentCap;
-		}
-		else if (m_currProbing == DOUBLEHASH) {
-			index = (index + i * (11 - (m_hash(model) % 11))) % m_currentCap;
+	// Search in the old table if it exists
+	if (m_oldTable != nullptr) {
+		m_oldLookups++;
+		index = findIn(m_oldTable, m_oldCtrl, m_oldMod, m_oldProbing, hash, modelId, dealer);
+		if (index >= 0) {
+			m_oldHits++;
+			return &m_oldTable[index];
 		}
+	}
 
-		i++;
+	// Car not found
+	return nullptr;
+}
+
+void CarDB::publishTables() {
+	ReadView* view = new ReadView();
+	view->m_current = { m_currentTable, m_currentCtrl, m_currentMod, m_currProbing };
+	view->m_old = { m_oldTable, m_oldCtrl, m_oldMod, m_oldProbing };
+	const ReadView* replaced = m_readView.exchange(view, memory_order_seq_cst);
+	if (replaced != nullptr)
+		m_epochs.retire(const_cast<ReadView*>(replaced), [](void* p) { delete static_cast<ReadView*>(p); });
+	m_epochs.collect();
+}
+
+void CarDB::retireTable(CarSlot* table, signed char* ctrl) {
+	if (table != nullptr && table == m_mappedTable) {
+		// the length travels with the mapping, munmap needs it
+		m_epochs.retire(new pair<CarSlot*, size_t>(table, m_mappedLength), [](void* p) {
+			pair<CarSlot*, size_t>* mapping = static_cast<pair<CarSlot*, size_t>*>(p);
+			munmap(mapping->first, mapping->second);
+			delete mapping;
+		});
+		m_mappedTable = nullptr;
 	}
+	else
+		m_epochs.retire(table, free);
+	if (ctrl != nullptr)
+		m_epochs.retire(ctrl, [](void* p) { delete[] static_cast<signed char*>(p); });
+	m_epochs.collect();
+}
 
-	// Search in the old table if it exists
-	if (m_oldTable != nullptr) {
-		// Hash the car model to get the index
-		index = m_hash(model) % m_oldCap;
-		i = 0;
-
-		while (m_oldTable[index].getUsed()) {
-			if (m_oldTable[index].getModel() == model && m_oldTable[index].getDealer() == dealer) {
-				// Car found in the old table
-				return m_oldTable[index];
-			}
+void CarDB::releaseTable(CarSlot* table) {
+	if (table != nullptr && table == m_mappedTable) {
+		munmap(table, m_mappedLength);
+		m_mappedTable = nullptr;
+	}
+	else
+		free(table);
+}
 
-			// Use quadratic or double-hash probing based on the old probing policy
-			if (m_oldProbing == QUADRATIC) {
-				index = (index + (i * i)) % m_oldCap;
-			}
-			else if (m_oldProbing == DOUBLEHASH) {
-				index = (index + i * (11 - (m_hash(model) % 11))) % m_oldCap;
-			}
+Car CarDB::readCar(string_view model, int dealer) const {
+	// the model dictionary and the hash cache are safe to read next to the writer
+	uint32_t modelId = m_models.find(model);
+	if (modelId == 0)
+		return EMPTY;
+	unsigned int hash = hashKey(modelId, dealer);
 
-			i++;
-		}
+	EpochDomain::Guard guard(m_epochs);
+	for (;;) {
+		uint64_t moves = m_moveSeq.load(memory_order_acquire);
+		const ReadView* view = m_readView.load(memory_order_seq_cst);
+		CarSlot found;
+		// a migration step copies a car into the current table before it clears it in
+		// the old one, but the two searches may straddle the step, so a miss is only
+		// trusted when no step ran in between
+		if ((view->m_current.m_table != nullptr && readIn(view->m_current, false, hash, modelId, dealer, found))
+			|| (view->m_old.m_table != nullptr && readIn(view->m_old, true, hash, modelId, dealer, found)))
+			return Car(m_models.name(modelId), found.m_quantity, dealer, true);
+		atomic_thread_fence(memory_order_acquire);
+		if ((moves & 1) == 0 && m_moveSeq.load(memory_order_relaxed) == moves)
+			return EMPTY;
 	}
+}
 
-	// Car not found
-	return EMPTY;
+bool CarDB::readIn(const TableView& view, bool old, unsigned int hash, uint32_t modelId, int dealer, CarSlot& found, long long* at) const {
+	long long capacity = view.m_mod.m_divisor;
+	long long index = view.m_mod.mod(hash);
+	if (view.m_probing == GROUPPROBE) {
+		// the control bytes are only a filter here, every candidate is checked through its slot;
+		// the group is copied byte by byte because the writer may be storing into it
+		signed char tag = hashTag(hash);
+		signed char group[GROUP_WIDTH];
+		for (long long visited = 0; visited < capacity; visited += GROUP_WIDTH) {
+			for (int b = 0; b < GROUP_WIDTH; b++)
+				group[b] = __atomic_load_n(view.m_ctrl + index + b, __ATOMIC_RELAXED);
+			uint32_t match = groupMatch(group, tag);
+			while (match != 0) {
+				long long candidate = index + __builtin_ctz(match);
+				if (candidate >= capacity)
+					candidate -= capacity;
+				view.m_table[candidate].load(found);
+				if (found.m_used && holds(found, modelId, dealer)) {
+					if (at != nullptr)
+						*at = candidate;
+					return true;
+				}
+				match &= match - 1;
+			}
+			if (groupMatch(group, CTRL_EMPTY) != 0)
+				return false;
+			index += GROUP_WIDTH;
+			if (index >= capacity)
+				index -= capacity;
+		}
+		return false;
+	}
+	// same probe as findIn, without counting probes
+	for (long long i = 0; i <= capacity; i++) {
+		view.m_table[index].load(found);
+		if (found.m_used && holds(found, modelId, dealer)) {
+			if (at != nullptr)
+				*at = index;
+			return true;
+		}
+		if (view.m_probing == ROBINHOOD && found.m_used && displacement(found, index, view.m_mod) < i)
+			return false;
+		if (!found.m_used && !(old && found.m_modelId != 0))
+			return false;
+		index = nextIndex(index, i, hash, view.m_mod, view.m_probing);
+	}
+	return false;
 }
 
 float CarDB::lambda() const {
+	unique_lock<recursive_mutex> lock = writerLock();
 	// Calculate and return the load factor of the current table
 	float totalOccupied = m_currentSize + m_currNumDeleted;
 	return totalOccupied / m_currentCap;
 }
 
 float CarDB::deletedRatio() const {
+	unique_lock<recursive_mutex> lock = writerLock();
 	// Calculate and return the ratio of deleted buckets to the total number of occupied buckets
 	float totalOccupied = m_currentSize;
 	if (totalOccupied == 0) {
@@ -269,74 +948,684 @@ float CarDB::deletedRatio() const {
 }
 
 void CarDB::dump() const {
-	cout << "Dump for the current table: " << endl;
+	unique_lock<recursive_mutex> lock = writerLock();
+	// one flush at the end instead of one per slot
+	cout << "Dump for the current table: " << '\n';
 	if (m_currentTable != nullptr)
-		for (int i = 0; i < m_currentCap; i++) {
-			cout << "[" << i << "] : " << m_currentTable[i] << endl;
+		for (long long i = 0; i < m_currentCap; i++) {
+			cout << "[" << i << "] : " << toCar(m_currentTable[i]) << '\n';
 		}
-	cout << "Dump for the old table: " << endl;
+	cout << "Dump for the old table: " << '\n';
 	if (m_oldTable != nullptr)
-		for (int i = 0; i < m_oldCap; i++) {
-			cout << "[" << i << "] : " << m_oldTable[i] << endl;
+		for (long long i = 0; i < m_oldCap; i++) {
+			cout << "[" << i << "] : " << toCar(m_oldTable[i]) << '\n';
 		}
+	cout << flush;
 }
 
-bool CarDB::updateQuantity(Car car, int quantity) {
-	// Hash the car model to get the index
-	int index = m_hash(car.getModel()) % m_currentCap;
-	int i = 0;
+CarIterator CarDB::begin() const {
+	CarIterator it(this);
+	it.start(m_currentTable, m_currentCtrl, m_currentCap, false);
+	it.advance();
+	return it;
+}
 
-	// Search in the current table
-	while (m_currentTable[index].getUsed()) {
-		if (m_currentTable[index] == car) {
-			// Car found, update its quantity
-			m_currentTable[index].setQuantity(quantity);
+size_t CarDB::exportCsv(ostream& out) const {
+	unique_lock<recursive_mutex> lock = writerLock();
+	static const size_t FLUSH_AT = 1 << 16;
+	string buffer;
+	buffer.reserve(FLUSH_AT + 256);
+	size_t cars = 0;
+	char digits[16];
+	for (const CarSlot& slot : *this) {
+		const string& model = m_models.name(slot.m_modelId);
+		// loadCsv trims a model and splits at commas and line breaks, a quoted one keeps
+		// them all; a quote inside is written twice
+		bool quoted = model.find_first_of(",\"\r\n") != string::npos || (!model.empty() && (isspace(static_cast<unsigned char>(model.front())) || isspace(static_cast<unsigned char>(model.back()))));
+		if (quoted) {
+			buffer += '"';
+			for (char c : model) {
+				buffer += c;
+				if (c == '"')
+					buffer += '"';
+			}
+			buffer += '"';
+		}
+		else
+			buffer += model;
+		buffer += ',';
+		buffer.append(digits, to_chars(digits, digits + sizeof(digits), slot.m_dealer).ptr);
+		buffer += ',';
+		buffer.append(digits, to_chars(digits, digits + sizeof(digits), slot.m_quantity).ptr);
+		buffer += '\n';
+		cars++;
+		if (buffer.size() >= FLUSH_AT) {
+			out.write(buffer.data(), buffer.size());
+			buffer.clear();
+		}
+	}
+	out.write(buffer.data(), buffer.size());
+	return cars;
+}
+
+void CarIterator::start(const CarSlot* slots, const signed char* ctrl, long long capacity, bool old) {
+	m_slots = slots;
+	m_ctrl = ctrl;
+	m_capacity = capacity;
+	m_old = old;
+	m_block = -64;
+	m_mask = 0;
+	m_index = 0;
+}
 
-			// Check for rehashing criteria and perform incremental rehashing if needed
+void CarIterator::advance() {
+	for (;;) {
+		while (m_mask == 0) {
+			m_block += 64;
+			if (m_block >= m_capacity) {
+				if (m_old || m_db->m_oldTable == nullptr) {
+					m_slots = nullptr;
+					m_index = 0;
+					return;
+				}
+				start(m_db->m_oldTable, m_db->m_oldCtrl, m_db->m_oldCap, true);
+				continue;
+			}
+			m_mask = CarDB::occupancy(m_slots, m_ctrl, m_capacity, m_block);
+		}
+		m_index = m_block + __builtin_ctzll(m_mask);
+		m_mask &= m_mask - 1;
+		// a car inserted during the migration shadows its copy in the old table
+		if (!m_old || !m_db->shadowed(m_slots[m_index]))
+			return;
+	}
+}
 
-			return true;
+uint64_t CarDB::occupancy(const CarSlot* table, const signed char* ctrl, long long capacity, long long block) {
+	long long count = min(64LL, capacity - block);
+	uint64_t mask = 0;
+	if (ctrl != nullptr && count == 64) {
+		// the control bytes answer for GROUP_WIDTH slots per compare, without touching a slot
+		for (int g = 0; g < 64; g += GROUP_WIDTH)
+			mask |= (static_cast<uint64_t>(~groupMatchFree(ctrl + block + g)) & ((1ULL << GROUP_WIDTH) - 1)) << g;
+		return mask;
+	}
+	for (long long i = 0; i < count; i++)
+		mask |= static_cast<uint64_t>(table[block + i].m_used) << i;
+	return mask;
+}
+
+bool CarDB::shadowed(const CarSlot& slot) const {
+	// the lookup of the concurrent readers, which counts no probes
+	TableView current = { m_currentTable, m_currentCtrl, m_currentMod, m_currProbing };
+	CarSlot found;
+	return readIn(current, false, slot.m_hashCode, slot.m_modelId, slot.m_dealer, found);
+}
+
+int CarDB::scanWorkers(int threads) {
+	return (threads > 0) ? threads : max(1, static_cast<int>(thread::hardware_concurrency()));
+}
+
+void CarDB::forEachChunk(int threads, const function<void(int worker, const ScanChunk& chunk)>& body) const {
+	unique_lock<recursive_mutex> lock = writerLock();
+	vector<ScanChunk> chunks;
+	auto cut = [&chunks](const CarSlot* table, const signed char* ctrl, long long capacity, bool old) {
+		// the chunks after the first start on a cache line, when any slot of the table does
+		long long skew = 0;
+		while (skew < 8 && (reinterpret_cast<uintptr_t>(table + skew) & 63) != 0)
+			skew++;
+		for (long long begin = 0; begin < capacity; ) {
+			long long end = min(capacity, ((skew < 8 && begin == 0) ? skew : begin) + SCAN_CHUNK);
+			chunks.push_back(ScanChunk{ table, ctrl, begin, end, old });
+			begin = end;
+		}
+	};
+	cut(m_currentTable, m_currentCtrl, m_currentCap, false);
+	if (m_oldTable != NULL)
+		cut(m_oldTable, m_oldCtrl, m_oldCap, true);
+
+	int workers = scanWorkers(threads);
+	if (m_scanPool == nullptr || m_scanPool->size() != workers)
+		m_scanPool.reset(new WorkerPool(workers));
+	// every worker owns a run of neighbouring chunks and helps with the other runs after
+	struct alignas(64) Run {
+		atomic<size_t> m_next;
+		size_t m_end;
+	};
+	unique_ptr<Run[]> runs(new Run[workers]);
+	for (int worker = 0; worker < workers; worker++) {
+		runs[worker].m_next.store(chunks.size() * worker / workers, memory_order_relaxed);
+		runs[worker].m_end = chunks.size() * (worker + 1) / workers;
+	}
+	m_scanPool->run([&](int worker) {
+		for (int k = 0; k < workers; k++) {
+			Run& run = runs[(worker + k) % workers];
+			for (size_t chunk; (chunk = run.m_next.fetch_add(1, memory_order_relaxed)) < run.m_end; )
+				body(worker, chunks[chunk]);
+		}
+	});
+}
+
+void CarDB::setDealerIndex(bool enabled) {
+	unique_lock<recursive_mutex> lock = writerLock();
+	m_dealerIndex.clear();
+	m_dealerIndex.shrink_to_fit();
+	if (!enabled)
+		return;
+	m_dealerIndex.resize(MAXID - MINID + 1);
+	for (long long i = 0; i < m_currentCap; i++) {
+		const CarSlot& slot = m_currentTable[i];
+		if (slot.m_used && slot.m_dealer >= MINID && slot.m_dealer <= MAXID)
+			m_dealerIndex[slot.m_dealer - MINID].push_back(slot.m_modelId);
+	}
+	// a car of the old table is only indexed once, the current table holds the live copy
+	for (long long i = 0; i < m_oldCap; i++) {
+		const CarSlot& slot = m_oldTable[i];
+		if (slot.m_used && slot.m_dealer >= MINID && slot.m_dealer <= MAXID
+			&& scanFor(m_currentTable, m_currentCtrl, m_currentMod, m_currProbing, slot.m_hashCode, slot.m_modelId, slot.m_dealer) < 0)
+			m_dealerIndex[slot.m_dealer - MINID].push_back(slot.m_modelId);
+	}
+}
+
+vector<Car> CarDB::getCarsAt(int dealer) const {
+	unique_lock<recursive_mutex> lock = writerLock();
+	vector<Car> cars;
+	if (!m_dealerIndex.empty() && dealer >= MINID && dealer <= MAXID) {
+		const vector<uint32_t>& models = m_dealerIndex[dealer - MINID];
+		cars.reserve(models.size());
+		for (uint32_t modelId : models) {
+			const CarSlot* slot = locate(modelId, dealer, hashKey(modelId, dealer));
+			if (slot != nullptr)
+				cars.push_back(toCar(*slot));
 		}
+		return cars;
+	}
+	for (long long i = 0; i < m_currentCap; i++)
+		if (m_currentTable[i].m_used && m_currentTable[i].m_dealer == dealer)
+			cars.push_back(toCar(m_currentTable[i]));
+	for (long long i = 0; i < m_oldCap; i++) {
+		const CarSlot& slot = m_oldTable[i];
+		if (slot.m_used && slot.m_dealer == dealer
+			&& scanFor(m_currentTable, m_currentCtrl, m_currentMod, m_currProbing, slot.m_hashCode, slot.m_modelId, slot.m_dealer) < 0)
+			cars.push_back(toCar(slot));
+	}
+	return cars;
+}
+
+ModelTotals CarDB::modelTotals(string_view model) const {
+	unique_lock<recursive_mutex> lock = writerLock();
+	uint32_t modelId = m_models.find(model);
+	if (modelId == 0 || modelId >= m_modelTotals.size())
+		return ModelTotals{ 0, 0 };
+	// quantity deltas add to the totals without the writer lock
+	const ModelTotals& totals = m_modelTotals[modelId];
+	return ModelTotals{ __atomic_load_n(&totals.m_quantity, __ATOMIC_RELAXED), totals.m_dealers };
+}
+
+const CarSlot* CarDB::oldCopy(uint32_t modelId, int dealer, unsigned int hash) const {
+	if (m_oldTable == NULL)
+		return nullptr;
+	// the lookup of locate, whose probes are bookkeeping and not counted for the call
+	long long probes = m_probeCount;
+	long long index = findIn(m_oldTable, m_oldCtrl, m_oldMod, m_oldProbing, hash, modelId, dealer);
+	m_probeCount = probes;
+	return (index >= 0) ? &m_oldTable[index] : nullptr;
+}
+
+ModelTotals& CarDB::totalsOf(uint32_t modelId) {
+	if (modelId >= m_modelTotals.size())
+		m_modelTotals.resize(modelId + 1, ModelTotals{ 0, 0 });
+	return m_modelTotals[modelId];
+}
+
+void CarDB::trackInsert(uint32_t modelId, int dealer, int quantity, unsigned int hash) {
+	ModelTotals& totals = totalsOf(modelId);
+	// insert only looks at the current table; a copy in the old one is shadowed from
+	// now on and dropped by the migration, so the new car takes its place
+	const CarSlot* shadowed = oldCopy(modelId, dealer, hash);
+	if (shadowed != nullptr) {
+		totals.m_quantity += quantity - shadowed->m_quantity;
+		return;
+	}
+	totals.m_quantity += quantity;
+	totals.m_dealers++;
+	if (!m_dealerIndex.empty() && dealer >= MINID && dealer <= MAXID)
+		m_dealerIndex[dealer - MINID].push_back(modelId);
+}
+
+void CarDB::trackRemove(uint32_t modelId, int dealer, int quantity, unsigned int hash) {
+	ModelTotals& totals = totalsOf(modelId);
+	// the old copy of a car removed from the current table is found again
+	const CarSlot* shadowed = oldCopy(modelId, dealer, hash);
+	if (shadowed != nullptr) {
+		totals.m_quantity += shadowed->m_quantity - quantity;
+		return;
+	}
+	totals.m_quantity -= quantity;
+	totals.m_dealers--;
+	if (m_dealerIndex.empty() || dealer < MINID || dealer > MAXID)
+		return;
+	vector<uint32_t>& models = m_dealerIndex[dealer - MINID];
+	for (size_t k = 0; k < models.size(); k++) {
+		if (models[k] == modelId) {
+			models[k] = models.back();
+			models.pop_back();
+			return;
+		}
+	}
+}
+
+bool CarDB::openJournal(const string& path, chrono::microseconds interval) {
+	unique_lock<recursive_mutex> lock = writerLock();
+	unique_ptr<Journal> journal(new Journal());
+	if (!journal->open(path, interval))
+		return false;
+	m_journal = std::move(journal);
+	return true;
+}
 
-		// Use quadratic or double-hash probing based on the current probing policy
-		if (m_currProbing == QUADRATIC) {
-			index = (index + (i * i)) % m_currentCap;
+void CarDB::syncJournal() {
+	unique_lock<recursive_mutex> lock = writerLock();
+	if (m_journal != nullptr)
+		m_journal->sync();
+}
+
+void CarDB::closeJournal() {
+	unique_lock<recursive_mutex> lock = writerLock();
+	m_journal.reset();	// writes and syncs what is buffered
+}
+
+long long CarDB::replayJournal(const string& path) {
+	unique_lock<recursive_mutex> lock = writerLock();
+	// the operations are already in the file they come from
+	unique_ptr<Journal> journal = std::move(m_journal);
+	long long operations = Journal::replay(path, [this](journalop_t op, const string& model, int dealer, int quantity) {
+		if (op == JOURNAL_INSERT)
+			emplace(model, quantity, dealer);
+		else if (op == JOURNAL_REMOVE)
+			remove(Car(model, 0, dealer, true));
+		else
+			updateQuantity(Car(model, 0, dealer, true), quantity);
+	});
+	m_journal = std::move(journal);
+	return operations;
+}
+
+CarDBStats CarDB::stats() const {
+	unique_lock<recursive_mutex> lock = writerLock();
+	CarDBStats stats;
+	for (int op = 0; op < NUM_STAT_OPS; op++) {
+		stats.m_ops[op] = m_opCount[op];
+		stats.m_probes[op] = m_opProbes[op];
+		for (int bucket = 0; bucket < PROBE_BUCKETS; bucket++)
+			stats.m_probeHist[op][bucket] = m_probeHist[op][bucket];
+	}
+	stats.m_oldLookups = m_oldLookups;
+	stats.m_oldHits = m_oldHits;
+	stats.m_migratedCars = m_migratedCars;
+	stats.m_rehashes = m_rehashes;
+	stats.m_tombstones = m_currNumDeleted + ((m_oldTable != nullptr) ? m_oldNumDeleted : 0);
+	stats.m_size = m_currentSize - m_currNumDeleted + ((m_oldTable != nullptr) ? m_oldSize - m_oldNumDeleted : 0);
+	stats.m_capacity = m_currentCap;
+	stats.m_oldCapacity = m_oldCap;
+	stats.m_loadFactor = lambda();
+	stats.m_migrationProgress = migrationProgress();
+	stats.m_policy = m_currProbing;
+	stats.m_equalHashes = m_equalHashes;
+	return stats;
+}
+
+bool CarDB::updateQuantity(const Car& car, int quantity) {
+	unique_lock<recursive_mutex> lock = writerLock();
+	uint32_t modelId = 0;
+	CarSlot* slot = updateSlot(car.m_model, car.m_dealer, modelId);
+	if (slot == nullptr)
+		return false;	// Car not found
+	// Car found in either table, update its quantity
+	setQuantity(slot, modelId, quantity);
+	adapt();
+	return true;
+}
+
+qtyresult_t CarDB::addQuantity(string_view model, int dealer, int delta, int& quantity) {
+	// the worker moves cars, so in the background mode deltas wait for it like any writer
+	unique_lock<recursive_mutex> lock = writerLock();
+	uint32_t modelId = 0;
+	CarSlot* slot = deltaSlot(model, dealer, modelId);
+	if (slot == nullptr)
+		return QTY_MISSING;
+	int current = __atomic_load_n(&slot->m_quantity, __ATOMIC_ACQUIRE);
+	for (;;) {
+		long long result = static_cast<long long>(current) + delta;
+		if (result < 0 || result > INT_MAX) {
+			quantity = current;	// a sale of more cars than the dealer has leaves them alone
+			return (result < 0) ? QTY_UNDERFLOW : QTY_OVERFLOW;
 		}
-		else if (m_currProbing == DOUBLEHASH) {
-			index = (index + i * (11 - (m_hash(car.getModel()) % 11))) % m_currentCap;
+		if (exchangeQuantity(slot, modelId, current, static_cast<int>(result))) {
+			quantity = static_cast<int>(result);
+			return QTY_DONE;
 		}
+	}
+}
+
+qtyresult_t CarDB::compareAndSetQuantity(string_view model, int dealer, int& expected, int desired) {
+	unique_lock<recursive_mutex> lock = writerLock();
+	uint32_t modelId = 0;
+	CarSlot* slot = deltaSlot(model, dealer, modelId);
+	if (slot == nullptr)
+		return QTY_MISSING;
+	int current = __atomic_load_n(&slot->m_quantity, __ATOMIC_ACQUIRE);
+	if (current != expected) {
+		expected = current;
+		return QTY_CONFLICT;
+	}
+	if (desired < 0)
+		return QTY_UNDERFLOW;
+	if (!exchangeQuantity(slot, modelId, current, desired)) {
+		expected = current;
+		return QTY_CONFLICT;
+	}
+	return QTY_DONE;
+}
+
+CarSlot* CarDB::deltaSlot(string_view model, int dealer, uint32_t& modelId) const {
+	modelId = m_models.find(model);
+	if (modelId == 0)
+		return nullptr;
+	unsigned int hash = hashKey(modelId, dealer);
+	// the reader probe counts nothing, so any number of deltas may look cars up at once;
+	// the view stays valid as long as no insert, remove or migration step runs
+	const ReadView* view = m_readView.load(memory_order_acquire);
+	CarSlot found;
+	long long index = -1;
+	if (view->m_current.m_table != nullptr && readIn(view->m_current, false, hash, modelId, dealer, found, &index))
+		return &view->m_current.m_table[index];
+	if (view->m_old.m_table != nullptr && readIn(view->m_old, true, hash, modelId, dealer, found, &index))
+		return &view->m_old.m_table[index];
+	return nullptr;
+}
+
+bool CarDB::exchangeQuantity(CarSlot* slot, uint32_t modelId, int& current, int desired) {
+	// one 32-bit field changes, a reader of the slot sees the old or the new quantity whole;
+	// with a journal the records of one key must be in the order of the exchanges
+	unique_lock<mutex> ordered;
+	if (m_journal != nullptr)
+		ordered = unique_lock<mutex>(m_deltaLock);
+	if (!__atomic_compare_exchange_n(&slot->m_quantity, &current, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return false;
+	__atomic_fetch_add(&m_modelTotals[modelId].m_quantity, static_cast<long long>(desired) - current, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&m_opCount[STAT_UPDATE], 1, __ATOMIC_RELAXED);
+	journal(JOURNAL_UPDATE, modelId, slot->m_dealer, desired);
+	return true;
+}
 
+CarSlot* CarDB::updateSlot(string_view model, int dealer, uint32_t& modelId) {
+	modelId = m_models.find(model);
+	if (modelId == 0)
+		return nullptr;
+	long long before = m_probeCount;
+	CarSlot* slot = locate(modelId, dealer, hashKey(modelId, dealer));
+	record(STAT_UPDATE, before);
+	return slot;
+}
+
+void CarDB::setQuantity(CarSlot* slot, uint32_t modelId, int quantity) {
+	totalsOf(modelId).m_quantity += static_cast<long long>(quantity) - slot->m_quantity;
+	slot->storeQuantity(quantity);
+	journal(JOURNAL_UPDATE, modelId, slot->m_dealer, quantity);
+}
+
+long long CarDB::findIn(const CarSlot* table, const signed char* ctrl, const FastMod& cap, prob_t probing,
+	unsigned int hash, uint32_t modelId, int dealer) const {
+	if (probing == GROUPPROBE)
+		return groupFind(table, ctrl, cap, hash, modelId, dealer);
+	if (probing == ROBINHOOD)
+		return robinFind(table, cap, hash, modelId, dealer);
+	long long index = cap.mod(hash);
+	long long i = 0;
+	// a lookup ends at the first free bucket; in the old table the buckets already
+	// migrated are passed over, else a migration would cut the probe chains of the rest
+	bool old = (table == m_oldTable);
+	while (table[index].getUsed() || (old && table[index].m_modelId != 0 && i <= static_cast<long long>(cap.m_divisor))) {
+		if (table[index].getUsed() && holds(table[index], modelId, dealer))
+			return index;
+
+		// Use quadratic or double-hash probing based on the policy of the table
+		index = nextIndex(index, i, hash, cap, probing);
+		m_probeCount++;
 		i++;
 	}
+	return -1;
+}
+
+long long CarDB::scanFor(const CarSlot* table, const signed char* ctrl, const FastMod& cap, prob_t probing,
+	unsigned int hash, uint32_t modelId, int dealer) const {
+	if (probing == GROUPPROBE)
+		return groupFind(table, ctrl, cap, hash, modelId, dealer);
+	if (probing == ROBINHOOD)
+		return robinFind(table, cap, hash, modelId, dealer);	// exact, a ROBINHOOD chain has no gaps
+	long long index = cap.mod(hash);
+	// removal walks the whole probe sequence instead of stopping at a free bucket
+	for (long long i = 0; i <= static_cast<long long>(cap.m_divisor); i++) {
+		if (table[index].getUsed() && holds(table[index], modelId, dealer))
+			return index;
+		index = nextIndex(index, i, hash, cap, probing);
+		if (i < static_cast<long long>(cap.m_divisor))
+			m_probeCount++;
+	}
+	return -1;
+}
 
-	// Search in the old table if it exists
-	if (m_oldTable != nullptr) {
-		// Hash the car model to get the index
-		index = m_hash(car.getModel()) % m_oldCap;
-		i = 0;
+long long CarDB::groupFind(const CarSlot* table, const signed char* ctrl, const FastMod& cap,
+	unsigned int hash, uint32_t modelId, int dealer) const {
+	long long capacity = cap.m_divisor;
+	long long pos = cap.mod(hash);
+	signed char tag = hashTag(hash);
+	// groups are visited in order, stepping by GROUP_WIDTH, until one holds an empty slot
+	for (long long visited = 0; visited < capacity; visited += GROUP_WIDTH) {
+		uint32_t match = groupMatch(ctrl + pos, tag);
+		while (match != 0) {
+			long long index = pos + __builtin_ctz(match);
+			if (index >= capacity)
+				index -= capacity;
+			if (holds(table[index], modelId, dealer))
+				return index;
+			match &= match - 1;
+		}
+		if (groupMatch(ctrl + pos, CTRL_EMPTY) != 0)
+			return -1;
+		pos += GROUP_WIDTH;
+		if (pos >= capacity)
+			pos -= capacity;
+		m_probeCount += GROUP_WIDTH;	// a group counts the slots it covers, like a step of the other policies
+	}
+	return -1;
+}
 
-		while (m_oldTable[index].getUsed()) {
-			if (m_oldTable[index] == car) {
-				// Car found in the old table, update its quantity
-				m_oldTable[index].setQuantity(quantity);
+long long CarDB::groupClaim(signed char* ctrl, const FastMod& cap, unsigned int hash) {
+	// the first empty or deleted slot of the probe sequence takes the key
+	long long index = groupFree(ctrl, cap, hash);
+	setCtrl(ctrl, cap.m_divisor, index, hashTag(hash));
+	return index;
+}
 
-				// Check for rehashing criteria and perform incremental rehashing if needed
+long long CarDB::groupFree(const signed char* ctrl, const FastMod& cap, unsigned int hash) const {
+	long long capacity = cap.m_divisor;
+	long long pos = cap.mod(hash);
+	for (;;) {
+		uint32_t free = groupMatchFree(ctrl + pos);
+		if (free != 0) {
+			long long index = pos + __builtin_ctz(free);
+			if (index >= capacity)
+				index -= capacity;
+			return index;
+		}
+		pos += GROUP_WIDTH;
+		if (pos >= capacity)
+			pos -= capacity;
+		m_probeCount += GROUP_WIDTH;
+	}
+}
 
-				return true;
-			}
-			// Use quadratic or double-hash probing based on the old probing policy
-			if (m_oldProbing == QUADRATIC) {
-				index = (index + (i * i)) % m_oldCap;
-			}
-			else if (m_oldProbing == DOUBLEHASH) {
-				index = (index + i * (11 - (m_hash(car.getModel()) % 11))) % m_oldCap;
-			}
+long long CarDB::displacement(const CarSlot& slot, long long index, const FastMod& cap) {
+	long long home = cap.mod(slot.m_hashCode);
+	return (index >= home) ? index - home : index + static_cast<long long>(cap.m_divisor) - home;
+}
 
-			i++;
+long long CarDB::robinFind(const CarSlot* table, const FastMod& cap, unsigned int hash, uint32_t modelId, int dealer) const {
+	long long capacity = cap.m_divisor;
+	long long index = cap.mod(hash);
+	// the cars of a chain are ordered by their distance from home, so the key is missing
+	// once a car closer to its home than the key would be shows up; in the old table the
+	// buckets already migrated are passed over, the cars left in it keep their places
+	bool old = (table == m_oldTable);
+	for (long long distance = 0; distance < capacity; distance++) {
+		const CarSlot& slot = table[index];
+		if (slot.getUsed()) {
+			if (holds(slot, modelId, dealer))
+				return index;
+			if (displacement(slot, index, cap) < distance)
+				return -1;
 		}
+		else if (!old || slot.m_modelId == 0)
+			return -1;
+		if (++index == capacity)
+			index = 0;
+		m_probeCount++;
 	}
+	return -1;
+}
 
-	// Car not found
-	return false;
+void CarDB::robinPlace(uint32_t modelId, int dealer, int quantity, unsigned int hash) {
+	CarSlot carried = CarSlot();
+	carried.m_modelId = modelId;	carried.m_dealer = dealer;
+	carried.m_quantity = quantity;	carried.m_hashCode = hash;
+	long long capacity = m_currentCap;
+	long long index = m_currentMod.mod(hash);
+	long long distance = 0;
+	bool moved = false;
+	while (m_currentTable[index].getUsed()) {
+		CarSlot& slot = m_currentTable[index];
+		long long theirs = displacement(slot, index, m_currentMod);
+		if (theirs < distance) {
+			// the car closer to its home gives up the bucket and probes on; it is out of
+			// the table until placed again, a reader that misses it meanwhile runs again
+			if (!moved) {
+				m_moveSeq.store(m_moveSeq.load(memory_order_relaxed) + 1, memory_order_relaxed);
+				atomic_thread_fence(memory_order_release);
+				moved = true;
+			}
+			CarSlot evicted = slot;
+			slot.store(carried.m_modelId, carried.m_dealer, carried.m_quantity, carried.m_hashCode, true);
+			carried = evicted;
+			distance = theirs;
+		}
+		if (++index == capacity)
+			index = 0;
+		distance++;
+		m_probeCount++;
+	}
+	m_currentTable[index].store(carried.m_modelId, carried.m_dealer, carried.m_quantity, carried.m_hashCode, true);
+	if (moved)
+		m_moveSeq.store(m_moveSeq.load(memory_order_relaxed) + 1, memory_order_release);
+}
+
+void CarDB::robinErase(long long index) {
+	long long capacity = m_currentCap;
+	m_moveSeq.store(m_moveSeq.load(memory_order_relaxed) + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	// every following car of the chain that is not in its home bucket moves one back
+	long long next = (index + 1 == capacity) ? 0 : index + 1;
+	while (m_currentTable[next].getUsed() && displacement(m_currentTable[next], next, m_currentMod) > 0) {
+		const CarSlot& slot = m_currentTable[next];
+		m_currentTable[index].store(slot.m_modelId, slot.m_dealer, slot.m_quantity, slot.m_hashCode, true);
+		index = next;
+		next = (next + 1 == capacity) ? 0 : next + 1;
+	}
+	m_currentTable[index].store(0, 0, 0, 0, false);
+	m_moveSeq.store(m_moveSeq.load(memory_order_relaxed) + 1, memory_order_release);
+	m_currentSize--;
+}
+
+CarSlot* CarDB::newTable(long long capacity) {
+	// calloc hands out fresh pages already zeroed, so a large table costs no fill
+	CarSlot* table = static_cast<CarSlot*>(calloc(capacity, sizeof(CarSlot)));
+	if (table == nullptr)
+		throw bad_alloc();
+	return table;
+}
+
+signed char* CarDB::newCtrl(long long capacity, prob_t probing) {
+	if (probing != GROUPPROBE)
+		return nullptr;
+	signed char* ctrl = new signed char[capacity + GROUP_WIDTH - 1];
+	for (long long i = 0; i < capacity + GROUP_WIDTH - 1; i++)
+		ctrl[i] = CTRL_EMPTY;
+	return ctrl;
+}
+
+void CarDB::setCtrl(signed char* ctrl, long long capacity, long long index, signed char value) {
+	// atomic, since concurrent readers may be copying the group
+	__atomic_store_n(ctrl + index, value, __ATOMIC_RELAXED);
+	// the bytes past the end of the array mirror the first GROUP_WIDTH - 1 slots
+	if (index < GROUP_WIDTH - 1)
+		__atomic_store_n(ctrl + capacity + index, value, __ATOMIC_RELAXED);
+}
+
+uint32_t CarDB::internModel(string_view model) {
+	uint32_t modelId = m_models.find(model);
+	if (modelId == 0 && !model.empty()) {
+		rememberModelHash(model);
+		modelId = m_models.intern(model);
+	}
+	return modelId;
+}
+
+uint32_t CarDB::internModel(string&& model) {
+	uint32_t modelId = m_models.find(model);
+	if (modelId == 0 && !model.empty()) {
+		rememberModelHash(model);
+		modelId = m_models.intern(std::move(model));
+	}
+	return modelId;
+}
+
+void CarDB::rememberModelHash(string_view model) {
+	// stored under the ID the model is about to get, before intern publishes it: a
+	// reader that finds the ID reads its hash at once
+	m_modelHashes.push_back(m_hash != nullptr ? m_hash(string(model)) : 0);
+}
+
+Car CarDB::toCar(const CarSlot& slot) const {
+	return Car(m_models.name(slot.m_modelId), slot.m_quantity, slot.m_dealer, slot.m_used);
+}
+
+unsigned int CarDB::hashKey(uint32_t modelId, int dealer) const {
+	if (m_keyHash != nullptr)
+		return m_keyHash(m_models.name(modelId), dealer);
+	unsigned int hash = m_modelHashes[modelId];
+	if (m_keyMode == COMPOSITEKEY) {
+		// fold the dealer in and finish with the murmur3 mixer so that
+		// neighbouring dealer IDs of one model land far apart
+		hash ^= static_cast<unsigned int>(dealer) * 0x9E3779B1u;
+		hash ^= hash >> 16;
+		hash *= 0x85EBCA6Bu;
+		hash ^= hash >> 13;
+		hash *= 0xC2B2AE35u;
+		hash ^= hash >> 16;
+	}
+	return hash;
+}
+
+long long CarDB::nextIndex(long long index, long long i, unsigned int hash, const FastMod& cap, prob_t probing) const {
+	unsigned long long next = index;
+	if (probing == QUADRATIC)
+		next += i * i;
+	else if (probing == DOUBLEHASH)
+		next += i * (11 - (hash % 11));
+	else if (probing == ROBINHOOD)
+		next += 1;
+	return cap.mod(next);
 }
 
 bool CarDB::isPrime(int number) {
@@ -350,21 +1639,222 @@ bool CarDB::isPrime(int number) {
 	return result;
 }
 
-int CarDB::findNextPrime(int current) {
-	//we always stay within the range [MINPRIME-MAXPRIME]
-	//the smallest prime starts at MINPRIME
+long long CarDB::findNextPrime(long long current) {
+	return capacityFor(current).m_divisor;
+}
+
+const FastMod& CarDB::capacityFor(long long current) {
+	//the smallest prime starts at MINPRIME, every other capacity is a rung of the ladder
+	//binary search for the first prime strictly greater than current
+	int low = 0, high = PRIME_LADDER_SIZE - 1;
 	if (current < MINPRIME) current = MINPRIME - 1;
-	for (int i = current; i < MAXPRIME; i++) {
-		for (int j = 2; j * j <= i; j++) {
-			if (i % j == 0)
-				break;
-			else if (j + 1 > sqrt(i) && i != current) {
-				return i;
-			}
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (static_cast<long long>(PRIME_LADDER[mid].m_divisor) > current)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+	//if a user tries to go over the top of the ladder
+	return PRIME_LADDER[low];
+}
+
+const Car Car::s_empty("", 0, 0, false);
+
+ModelDict::ModelDict() {
+	m_names.push_back("");
+	unique_ptr<Index> index(new Index());
+	index->m_mask = 15;
+	index->m_ids.reset(new atomic<uint32_t>[16]());
+	m_index.store(index.get(), memory_order_release);
+	m_indexes.push_back(std::move(index));
+}
+
+uint32_t ModelDict::find(string_view name) const {
+	const Index* index = m_index.load(memory_order_acquire);
+	for (size_t pos = hash<string_view>()(name) & index->m_mask;; pos = (pos + 1) & index->m_mask) {
+		uint32_t id = index->m_ids[pos].load(memory_order_acquire);
+		if (id == 0)
+			return 0;
+		if (m_names[id] == name)
+			return id;
+	}
+}
+
+uint32_t ModelDict::intern(string_view name) {
+	uint32_t id = find(name);
+	if (id == 0 && !name.empty())
+		id = add(string(name));
+	return id;
+}
+
+uint32_t ModelDict::intern(string&& name) {
+	uint32_t id = find(name);
+	if (id == 0 && !name.empty())
+		id = add(std::move(name));
+	return id;
+}
+
+uint32_t ModelDict::add(string&& name) {
+	uint32_t id = size();
+	m_names.push_back(std::move(name));
+	const Index* index = m_index.load(memory_order_relaxed);
+	// keep the index at most half full; readers move to the copy once it is complete
+	if (2 * (static_cast<size_t>(id) + 1) > index->m_mask + 1) {
+		unique_ptr<Index> grown(new Index());
+		grown->m_mask = 2 * index->m_mask + 1;
+		grown->m_ids.reset(new atomic<uint32_t>[grown->m_mask + 1]());
+		for (uint32_t old = 1; old < id; old++)
+			place(*grown, old);
+		m_index.store(grown.get(), memory_order_release);
+		m_indexes.push_back(std::move(grown));
+		index = m_indexes.back().get();
+	}
+	place(*index, id);
+	return id;
+}
+
+void ModelDict::place(const Index& index, uint32_t id) const {
+	size_t pos = hash<string_view>()(m_names[id]) & index.m_mask;
+	while (index.m_ids[pos].load(memory_order_relaxed) != 0)
+		pos = (pos + 1) & index.m_mask;
+	index.m_ids[pos].store(id, memory_order_release);
+}
+
+void CarSlot::store(uint32_t modelId, int dealer, int quantity, unsigned int hashCode, bool used) {
+	__atomic_store_n(&m_seq, m_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&m_modelId, modelId, __ATOMIC_RELAXED);
+	__atomic_store_n(&m_dealer, dealer, __ATOMIC_RELAXED);
+	__atomic_store_n(&m_quantity, quantity, __ATOMIC_RELAXED);
+	__atomic_store_n(&m_hashCode, hashCode, __ATOMIC_RELAXED);
+	__atomic_store_n(&m_used, used, __ATOMIC_RELAXED);
+	__atomic_store_n(&m_seq, m_seq + 1, __ATOMIC_RELEASE);
+}
+
+void CarSlot::storeUsed(bool used) {
+	__atomic_store_n(&m_seq, m_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&m_used, used, __ATOMIC_RELAXED);
+	__atomic_store_n(&m_seq, m_seq + 1, __ATOMIC_RELEASE);
+}
+
+void CarSlot::storeQuantity(int quantity) {
+	__atomic_store_n(&m_seq, m_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&m_quantity, quantity, __ATOMIC_RELAXED);
+	__atomic_store_n(&m_seq, m_seq + 1, __ATOMIC_RELEASE);
+}
+
+void CarSlot::load(CarSlot& copy) const {
+	for (;;) {
+		uint32_t seq = __atomic_load_n(&m_seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;	// the writer is in the middle of a store
+		copy.m_modelId = __atomic_load_n(&m_modelId, __ATOMIC_RELAXED);
+		copy.m_dealer = __atomic_load_n(&m_dealer, __ATOMIC_RELAXED);
+		copy.m_quantity = __atomic_load_n(&m_quantity, __ATOMIC_RELAXED);
+		copy.m_hashCode = __atomic_load_n(&m_hashCode, __ATOMIC_RELAXED);
+		copy.m_used = __atomic_load_n(&m_used, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&m_seq, __ATOMIC_RELAXED) == seq)
+			return;
+	}
+}
+
+const char* CarDBStats::opName(int op) {
+	static const char* names[NUM_STAT_OPS] = { "insert", "remove", "find", "update" };
+	return names[op];
+}
+
+long long CarDBStats::bucketLimit(int bucket) {
+	if (bucket == PROBE_BUCKETS - 1)
+		return -1;
+	return (1LL << bucket) - 1;
+}
+
+static const char* policyName(prob_t policy) {
+	switch (policy) {
+	case QUADRATIC: return "QUADRATIC";
+	case DOUBLEHASH: return "DOUBLEHASH";
+	case GROUPPROBE: return "GROUPPROBE";
+	case ROBINHOOD: return "ROBINHOOD";
+	default: return "NONE";
+	}
+}
+
+string CarDBStats::toPrometheus(const string& prefix) const {
+	ostringstream out;
+	out << "# HELP " << prefix << "_ops_total Calls per operation.\n";
+	out << "# TYPE " << prefix << "_ops_total counter\n";
+	for (int op = 0; op < NUM_STAT_OPS; op++)
+		out << prefix << "_ops_total{op=\"" << opName(op) << "\"} " << m_ops[op] << "\n";
+	// Prometheus buckets are cumulative, each counts the calls of at most le steps
+	out << "# HELP " << prefix << "_probe_length Probe steps per call.\n";
+	out << "# TYPE " << prefix << "_probe_length histogram\n";
+	for (int op = 0; op < NUM_STAT_OPS; op++) {
+		long long cumulative = 0;
+		for (int bucket = 0; bucket < PROBE_BUCKETS; bucket++) {
+			cumulative += m_probeHist[op][bucket];
+			long long limit = bucketLimit(bucket);
+			out << prefix << "_probe_length_bucket{op=\"" << opName(op) << "\",le=\""
+				<< ((limit < 0) ? string("+Inf") : to_string(limit)) << "\"} " << cumulative << "\n";
 		}
+		out << prefix << "_probe_length_sum{op=\"" << opName(op) << "\"} " << m_probes[op] << "\n";
+		out << prefix << "_probe_length_count{op=\"" << opName(op) << "\"} " << m_ops[op] << "\n";
+	}
+	const struct { const char* name; const char* type; const char* help; double value; } metrics[] = {
+		{ "old_lookups_total", "counter", "Lookups that searched the old table.", static_cast<double>(m_oldLookups) },
+		{ "old_hits_total", "counter", "Lookups that found the car in the old table.", static_cast<double>(m_oldHits) },
+		{ "migrated_cars_total", "counter", "Cars moved from an old table.", static_cast<double>(m_migratedCars) },
+		{ "rehashes_total", "counter", "Rehashes started.", static_cast<double>(m_rehashes) },
+		{ "tombstones", "gauge", "Deleted buckets in both tables.", static_cast<double>(m_tombstones) },
+		{ "size", "gauge", "Live cars.", static_cast<double>(m_size) },
+		{ "capacity", "gauge", "Buckets of the current table.", static_cast<double>(m_capacity) },
+		{ "old_capacity", "gauge", "Buckets of the old table.", static_cast<double>(m_oldCapacity) },
+		{ "load_factor", "gauge", "Load factor of the current table.", m_loadFactor },
+		{ "migration_progress", "gauge", "Share of the old table migrated.", m_migrationProgress },
+		{ "equal_hashes", "gauge", "1 when most cars share their hash.", m_equalHashes ? 1.0 : 0.0 },
+	};
+	for (const auto& metric : metrics) {
+		out << "# HELP " << prefix << "_" << metric.name << " " << metric.help << "\n";
+		out << "# TYPE " << prefix << "_" << metric.name << " " << metric.type << "\n";
+		out << prefix << "_" << metric.name << " " << metric.value << "\n";
+	}
+	out << "# HELP " << prefix << "_policy Collision handling policy of the current table.\n";
+	out << "# TYPE " << prefix << "_policy gauge\n";
+	out << prefix << "_policy{policy=\"" << policyName(m_policy) << "\"} 1\n";
+	return out.str();
+}
+
+string CarDBStats::toJson() const {
+	ostringstream out;
+	out << "{\"ops\":{";
+	for (int op = 0; op < NUM_STAT_OPS; op++) {
+		out << ((op > 0) ? "," : "") << "\"" << opName(op) << "\":{\"count\":" << m_ops[op]
+			<< ",\"probes\":" << m_probes[op] << ",\"probe_histogram\":[";
+		for (int bucket = 0; bucket < PROBE_BUCKETS; bucket++)
+			out << ((bucket > 0) ? "," : "") << m_probeHist[op][bucket];
+		out << "]}";
+	}
+	out << "},\"probe_bucket_limits\":[";
+	for (int bucket = 0; bucket < PROBE_BUCKETS; bucket++) {
+		long long limit = bucketLimit(bucket);
+		out << ((bucket > 0) ? "," : "") << ((limit < 0) ? string("null") : to_string(limit));
 	}
-	//if a user tries to go over MAXPRIME
-	return MAXPRIME;
+	out << "],\"old_lookups\":" << m_oldLookups
+		<< ",\"old_hits\":" << m_oldHits
+		<< ",\"migrated_cars\":" << m_migratedCars
+		<< ",\"rehashes\":" << m_rehashes
+		<< ",\"tombstones\":" << m_tombstones
+		<< ",\"size\":" << m_size
+		<< ",\"capacity\":" << m_capacity
+		<< ",\"old_capacity\":" << m_oldCapacity
+		<< ",\"load_factor\":" << m_loadFactor
+		<< ",\"migration_progress\":" << m_migrationProgress
+		<< ",\"equal_hashes\":" << (m_equalHashes ? "true" : "false")
+		<< ",\"policy\":\"" << policyName(m_policy) << "\"}";
+	return out.str();
 }
 
 ostream& operator<<(ostream& sout, const Car& car) {
@@ -3,19 +3,60 @@
 #define DEALER_H
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <iterator>
 #include "math.h"
+#include "concurrent.h"
+#include "journal.h"
 using namespace std;
 class Grader;
 class Tester;
+class Bench;
+class ShardedCarDB;
 class Car;
+class CarSlot;
+class ModelDict;
+struct SnapshotHeader;
 class CarDB;
 const int MINID = 1000;     // dealer ID
 const int MAXID = 9999;     // dealer ID
 const int MINPRIME = 101;   // Min size for hash table
-const int MAXPRIME = 99991; // Max size for hash table
-#define EMPTY Car("",0,0,false)
+const int MAXPRIME = 99991; // Max size of the original fixed-range table, capacities now grow past it
+#define EMPTY Car::s_empty
 typedef unsigned int (*hash_fn)(string); // declaration of hash function
-enum prob_t { NONE, QUADRATIC, DOUBLEHASH }; // types of collision handling policy
+typedef unsigned int (*key_hash_fn)(const string& model, int dealer); // hash function over the whole (model, dealer) key
+enum prob_t { NONE, QUADRATIC, DOUBLEHASH, GROUPPROBE, ROBINHOOD }; // types of collision handling policy
+// GROUPPROBE keeps a control byte per slot (empty, deleted or a 7-bit hash tag) in a
+// separate array and compares a whole group of them with one SIMD instruction
+// ROBINHOOD probes linearly, an insert takes the bucket of any car closer to its home
+// and remove shifts the cars after it back, so its tables never hold deleted buckets
+enum keymode_t { MODELKEY, COMPOSITEKEY }; // whether the dealer ID is mixed into the hash of a hash_fn
+// outcome of addQuantity and compareAndSetQuantity; only QTY_DONE changes the car
+enum qtyresult_t { QTY_DONE, QTY_MISSING, QTY_UNDERFLOW, QTY_OVERFLOW, QTY_CONFLICT };
+
+// A table capacity together with its precomputed reciprocal, so that x % capacity
+// becomes two multiplications instead of a 64-bit division
+// (Lemire, Kaser and Kurz, "Faster Remainder by Direct Computation")
+struct FastMod {
+	constexpr FastMod(uint64_t divisor = 1) : m_magic(~static_cast<unsigned __int128>(0) / divisor + 1), m_divisor(divisor) {}
+	uint64_t mod(uint64_t x) const {
+		unsigned __int128 low = m_magic * x;
+		// the remainder is the top 64 bits of the 192-bit product low * m_divisor
+		unsigned __int128 bottom = (static_cast<unsigned __int128>(static_cast<uint64_t>(low)) * m_divisor) >> 64;
+		unsigned __int128 top = (low >> 64) * m_divisor;
+		return static_cast<uint64_t>((bottom + top) >> 64);
+	}
+	unsigned __int128 m_magic;
+	uint64_t m_divisor;
+};
 #define DEFPOLCY QUADRATIC
 
 class Car {
@@ -24,7 +65,7 @@ class Car {
 	friend class CarDB;
 public:
 	Car(string model = "", int quantity = 0, int dealer = 0, bool used = false) {
-		m_model = model;
+		m_model = std::move(model);
 		m_quantity = quantity;
 		m_dealer = dealer;
 		m_used = used;
@@ -37,6 +78,9 @@ public:
 	int getQuantity() const { return m_quantity; }
 	int getDealer() const { return m_dealer; }
 	bool getUsed() const { return m_used; }
+	Car(const Car& rhs) = default;
+	Car(Car&& rhs) = default;
+	Car& operator=(Car&& rhs) = default;
 	// overloaded assignment operator
 	const Car& operator=(const Car& rhs) {
 		if (this != &rhs) {
@@ -51,6 +95,8 @@ public:
 	friend ostream& operator<<(ostream& sout, const Car& d);
 	// Overloaded equality operator
 	friend bool operator==(const Car& lhs, const Car& rhs);
+	// the empty car, compared against and returned for a missing car
+	static const Car s_empty;
 private:
 	string m_model;     // car type, used as a key for finding index in hash table 
 	int m_quantity;     // number of card delivered to the dealer
@@ -61,54 +107,476 @@ private:
 	bool m_used; //////
 };
 
+// One bucket of a CarDB table. The model is stored as its ID in the model dictionary
+// of the owning CarDB, so a slot is a few integers and holds no heap memory.
+// The writer changes a slot only through the store functions, which bump m_seq to
+// odd and back to even around the change; a reader copies the slot with load, which
+// retries until it saw the same even m_seq before and after.
+class CarSlot {
+	friend class Tester;
+	friend class Grader;
+	friend class CarDB;
+public:
+	uint32_t getModelId() const { return m_modelId; }
+	int getQuantity() const { return m_quantity; }
+	int getDealer() const { return m_dealer; }
+	bool getUsed() const { return m_used; }
+private:
+	uint32_t m_modelId;      // model ID, 0 only for a bucket that was never used
+	int m_dealer;            // model and dealer together are the key
+	int m_quantity;
+	// hash of (model, dealer) under the CarDB key mode, migration reuses it instead of rehashing
+	unsigned int m_hashCode;
+	bool m_used;             // same lazy delete scheme as Car::m_used
+	uint32_t m_seq;          // sequence lock, odd while the writer is changing the slot
+
+	void store(uint32_t modelId, int dealer, int quantity, unsigned int hashCode, bool used);
+	void storeUsed(bool used);
+	void storeQuantity(int quantity);
+	void load(CarSlot& copy) const;	// consistent copy while the writer may be storing
+};
+
+// Model names seen by a CarDB. Every distinct name gets a dense 32-bit ID, ID 0 is
+// reserved for the empty name of unused buckets. IDs are never reused.
+// One thread interns while others may call find and name: names never move once
+// stored, and the name to ID index is an open addressing array of IDs whose entries
+// are published with a release store. A full index is copied into one twice the size;
+// the old copies stay alive until the dictionary is destroyed, at most doubling its size.
+class ModelDict {
+public:
+	ModelDict();
+	ModelDict(const ModelDict&) = delete;
+	ModelDict& operator=(const ModelDict&) = delete;
+	// ID of the name, 0 if the name was never interned; does not allocate
+	uint32_t find(string_view name) const;
+	// ID of the name, adding it to the dictionary if needed
+	uint32_t intern(string_view name);
+	uint32_t intern(string&& name);
+	const string& name(uint32_t id) const { return m_names[id]; }
+	// number of IDs handed out, including the reserved 0
+	uint32_t size() const { return static_cast<uint32_t>(m_names.size()); }
+private:
+	struct Index {
+		size_t m_mask;                      // capacity - 1, the capacity is a power of two
+		unique_ptr<atomic<uint32_t>[]> m_ids;	// 0 for a free entry
+	};
+	SegmentedArray<string> m_names;
+	atomic<const Index*> m_index;
+	vector<unique_ptr<Index>> m_indexes;   // the current index and every one it replaced
+
+	uint32_t add(string&& name);            // a name that is not in the dictionary yet
+	void place(const Index& index, uint32_t id) const;
+};
+
+// Operations counted by CarDB::stats; the batch calls count once per car
+enum statop_t { STAT_INSERT, STAT_REMOVE, STAT_FIND, STAT_UPDATE, NUM_STAT_OPS };
+// Probe length buckets: 0 steps, 1, 2-3, 4-7, ..., 32-63 and 64 or more
+const int PROBE_BUCKETS = 8;
+
+// What CarDB::loadCsv did with the rows of a file
+struct CsvLoadReport {
+	long long m_rows;           // data rows, without a header line and blank lines
+	long long m_inserted;
+	long long m_duplicates;     // rows of a car already stored, or stored by an earlier row
+	long long m_rejected;       // malformed rows and rows equal to EMPTY, as insert rejects them
+	double m_seconds;
+	double rowsPerSecond() const { return (m_seconds > 0) ? m_rows / m_seconds : 0; }
+};
+
+// Forward iterator over the live cars of a CarDB: the current table, then the cars of
+// the old table that have not migrated yet, each car once. Occupancy is read 64 slots
+// at a time into a bit mask, from the control bytes of a GROUPPROBE table, and the set
+// bits are visited with count-trailing-zeros, so free buckets cost no per-slot branch.
+// The database must not change while an iterator is in use; the incremental
+// migration only runs inside writer calls, a background worker has to be waited for.
+class CarIterator {
+public:
+	using iterator_category = forward_iterator_tag;
+	using value_type = CarSlot;
+	using difference_type = ptrdiff_t;
+	using pointer = const CarSlot*;
+	using reference = const CarSlot&;
+
+	reference operator*() const { return m_slots[m_index]; }
+	pointer operator->() const { return m_slots + m_index; }
+	CarIterator& operator++() { advance(); return *this; }
+	CarIterator operator++(int) { CarIterator previous = *this; advance(); return previous; }
+	bool operator==(const CarIterator& other) const { return m_slots == other.m_slots && m_index == other.m_index; }
+	bool operator!=(const CarIterator& other) const { return !(*this == other); }
+private:
+	friend class CarDB;
+	explicit CarIterator(const CarDB* db) : m_db(db), m_slots(nullptr), m_ctrl(nullptr), m_capacity(0), m_old(false), m_block(0), m_mask(0), m_index(0) {}
+	const CarDB* m_db;
+	const CarSlot* m_slots;         // table walked, nullptr at the end
+	const signed char* m_ctrl;
+	long long m_capacity;
+	bool m_old;                     // walking the old table
+	long long m_block;              // first slot of the mask
+	uint64_t m_mask;                // live slots of the block not visited yet
+	long long m_index;
+
+	void start(const CarSlot* slots, const signed char* ctrl, long long capacity, bool old);
+	void advance();	// on to the next live car, or the end
+};
+
+// Stock of one model over all dealers
+struct ModelTotals {
+	long long m_quantity;       // sum of the quantities of its cars
+	long long m_dealers;        // cars of the model, one per dealer
+};
+
+// Counters of a CarDB since it was built, and its table shape when they were read
+struct CarDBStats {
+	long long m_ops[NUM_STAT_OPS];
+	long long m_probes[NUM_STAT_OPS];                   // probe steps of all calls of the operation, in slots
+	long long m_probeHist[NUM_STAT_OPS][PROBE_BUCKETS]; // calls per probe length bucket
+	long long m_oldLookups;     // lookups that missed the current table and searched the old one
+	long long m_oldHits;        // of those, lookups that found the car in the old table
+	long long m_migratedCars;   // cars moved from an old table into the current one
+	long long m_rehashes;       // old tables started, for growth, shrinking, tombstones or a policy change
+	long long m_tombstones;     // deleted buckets in both tables
+	long long m_size;           // live cars in both tables
+	long long m_capacity;       // buckets of the current table
+	long long m_oldCapacity;    // buckets of the old table, 0 when no migration runs
+	double m_loadFactor;        // lambda of the current table
+	double m_migrationProgress;
+	prob_t m_policy;
+	bool m_equalHashes;         // adapt found most cars sharing their hash, COMPOSITEKEY would spread them
+
+	static const char* opName(int op);	// "insert", "remove", "find" or "update"
+	static long long bucketLimit(int bucket);	// largest probe length of a bucket, -1 for the last
+	string toPrometheus(const string& prefix = "cardb") const;	// text exposition format
+	string toJson() const;
+};
+
 class CarDB {
 public:
+	friend class CarIterator;
 	friend class Grader;
 	friend class Tester;
-	CarDB(int size, hash_fn hash, prob_t probing);
+	friend class Bench;
+	friend class ShardedCarDB;
+	CarDB(int size, hash_fn hash, prob_t probing, keymode_t keyMode = MODELKEY);
+	// the table hashes the whole key with the given function
+	CarDB(int size, key_hash_fn hash, prob_t probing);
 	~CarDB();
 	// Returns Load factor of the new table
 	float lambda() const;
 	// Returns the ratio of deleted slots in the new table
 	float deletedRatio() const;
 	// insert only happens in the new table
-	bool insert(Car car);
+	bool insert(const Car& car);
+	bool insert(Car&& car);	// a new model name is moved into the model dictionary
+	bool emplace(string_view model, int quantity, int dealer);	// insert without building a Car
 	// remove can happen from either table
-	bool remove(Car car);
+	bool remove(const Car& car);
 	// find can happen in either table
-	Car getCar(string model, int dealer) const;
+	Car getCar(string_view model, int dealer) const;
+	// the slot holding the car, nullptr if missing; no copy and no allocation,
+	// the pointer is valid until the next call that modifies the database
+	const CarSlot* findCar(string_view model, int dealer) const;
+	const string& modelName(const CarSlot& slot) const { return m_models.name(slot.getModelId()); }
 	// update the information
-	bool updateQuantity(Car car, int quantity);
+	bool updateQuantity(const Car& car, int quantity);
+	// Changes the quantity of a car in place, in whichever table holds it, with one
+	// compare-and-swap on the quantity; the model totals follow with an atomic add.
+	// addQuantity adds delta and sets quantity to the new value; a result below 0 or
+	// above INT_MAX gives QTY_UNDERFLOW or QTY_OVERFLOW and the current value.
+	// compareAndSetQuantity stores desired only while the quantity is expected,
+	// otherwise it gives QTY_CONFLICT and the current value in expected. A missing car
+	// gives QTY_MISSING. Any number of threads may call both at once, next to getCar in
+	// the concurrent read mode and modelTotals, but no other call may run meanwhile: an
+	// insert, remove or migration step moves slots under them (ShardedCarDB keeps that
+	// apart with the shard lock, the background mode with the writer lock). They count
+	// as updates in stats, without probes, and never start a rehash.
+	qtyresult_t addQuantity(string_view model, int dealer, int delta, int& quantity);
+	qtyresult_t compareAndSetQuantity(string_view model, int dealer, int& expected, int desired);
+	// batch versions of insert, getCar and updateQuantity; all keys are hashed up front,
+	// home buckets are prefetched ahead of the probes and migration runs once per batch,
+	// in whichever mode it is set to; they return the number of cars inserted, found or updated
+	size_t insertBatch(const Car* cars, size_t count);
+	size_t getCars(const Car* keys, size_t count, Car* results) const;	// results[k] is EMPTY for a missing key
+	size_t updateQuantities(const Car* cars, const int* quantities, size_t count);
+	// the policy changes through a rehash into a table of the new policy, started at once,
+	// or when the rehash in progress has finished
 	void changeProbPolicy(prob_t policy);
+	// reserve sizes the table for n live cars, so inserts up to n start no rehash, and
+	// keeps every later table at least that large. shrink_to_fit drops that floor and
+	// moves the cars into the smallest table the live cars allow. Both rehash
+	// incrementally like any growth, at once or when the rehash in progress has
+	// finished; with a step budget a table shrinks at most by half per rehash.
+	void reserve(long long n);
+	void shrink_to_fit();
+	// In adaptive mode the probe steps of every call are counted. When a window of
+	// calls averaged more than maxAvgProbes steps or one call took more than maxProbes,
+	// a table of mostly tombstones is rehashed. When most cars share their whole hash no
+	// policy helps, stats reports m_equalHashes and the table stays as it is; otherwise
+	// the policy moves on from QUADRATIC to DOUBLEHASH to GROUPPROBE. The first window
+	// after the rehash judges the change, one that did not lower the average is undone.
+	void setAdaptivePolicy(bool enabled, double maxAvgProbes = 4.0, long long maxProbes = 64);
+	// counters of all calls so far; lock-free getCar calls of the concurrent read mode are not counted
+	CarDBStats stats() const;
 	void dump() const;
+	// live cars in both tables, see CarIterator
+	CarIterator begin() const;
+	CarIterator end() const { return CarIterator(this); }
+	// Writes every live car as a "model,dealer,quantity" line that loadCsv reads back,
+	// through one buffer instead of a stream call per field; returns the cars written
+	size_t exportCsv(ostream& out) const;
+	// Calls fn(slot) for every live car, the cars the iterator visits, on threads
+	// threads (0: one per core). Both tables are cut into chunks starting on a cache
+	// line; every thread works through its own run of chunks, then takes the chunks
+	// left in the runs of the others. fn runs concurrently and must not call the database.
+	template <class Fn>
+	void parallelForEach(Fn fn, int threads = 0) const {
+		scanLive(threads, [&fn](int, const CarSlot& slot) { fn(slot); });
+	}
+	// Folds the live cars into one partial result per thread with map(partial, slot),
+	// every partial starting as identity, then merges them in order with merge(result, partial)
+	template <class T, class Map, class Merge>
+	T parallelReduce(T identity, Map map, Merge merge, int threads = 0) const {
+		struct alignas(64) Partial { T m_value; };	// a cache line of its own
+		vector<Partial> partials(scanWorkers(threads), Partial{ identity });
+		scanLive(threads, [&](int worker, const CarSlot& slot) { map(partials[worker].m_value, slot); });
+		T result = identity;
+		for (const Partial& partial : partials)
+			merge(result, partial.m_value);
+		return result;
+	}
+	// With the dealer index on, every dealer ID from MINID to MAXID keeps the model IDs
+	// of its cars, so getCarsAt costs time in the cars it returns instead of a scan of
+	// both tables. Turning it on builds it from the tables.
+	void setDealerIndex(bool enabled);
+	// every car of the dealer; without the index, or for a dealer outside MINID..MAXID,
+	// the tables are scanned
+	vector<Car> getCarsAt(int dealer) const;
+	// total quantity and number of dealers of a model, kept up by every change;
+	// zeros for a model never stored
+	ModelTotals modelTotals(string_view model) const;
+	// In concurrent read mode getCar may run on any number of threads, without locks,
+	// while one writer thread makes all the other calls. Readers see every table through
+	// a published snapshot, retired tables are freed through epoch-based reclamation and
+	// a lookup that raced with a migration step runs again. findCar, getCars and the
+	// writer calls stay single threaded. Set it before readers start.
+	void setConcurrentReads(bool enabled) { m_concurrentReads = enabled; }
+	// In background migration mode a worker thread drains the old table, budget old
+	// slots per step with a pause between steps, and insert and remove no longer migrate.
+	// Every call then takes an internal lock, so several threads may share the database.
+	// Switch it while no other thread uses the database.
+	void setBackgroundMigration(bool enabled, long long budget = 1024, chrono::microseconds pause = chrono::microseconds(0));
+	void waitForMigration();	// returns once no old table is left, migrating inline when there is no worker
+	double migrationProgress() const;	// share of the old table's cars moved so far, 1 when no migration runs
+	// With a step budget every insert and remove migrates by scanning the next slots old
+	// slots from where the previous call stopped, instead of a quarter of the old table
+	// from its start, so no single call does work proportional to the table size.
+	// 0 restores increamental_Transfer; budgets below 8 are raised to 8.
+	void setMigrationBudget(long long slots);
+	// Writes the current table, model names and model hashes to a snapshot file, after
+	// finishing a running migration; false if the file could not be written
+	bool saveSnapshot(const string& path);
+	// A database over a snapshot, built with the hash function it was saved under. The
+	// slots are mapped from the file copy on write, so the OS reads them on first use.
+	// nullptr for a missing file, a damaged header, model name or model hash, another
+	// format version or byte order, or a different hash function. The slots themselves
+	// are not checked, so that opening does not read them.
+	static unique_ptr<CarDB> openSnapshot(const string& path, hash_fn hash);
+	static unique_ptr<CarDB> openSnapshot(const string& path, key_hash_fn hash);
+	// Records every insert, remove and quantity update that changes the database in a
+	// journal file, which reaches the disk in groups every interval (0: on every call).
+	// saveSnapshot empties the journal, as the snapshot holds all it recorded. After a
+	// crash, openSnapshot and replayJournal restore the database, then openJournal
+	// carries on with the same file.
+	bool openJournal(const string& path, chrono::microseconds interval = chrono::milliseconds(5));
+	void syncJournal();	// returns once every change so far is on disk
+	void closeJournal();
+	// Applies the operations of a journal, up to a torn last group; none of them is
+	// journalled again. Returns the operations read, -1 if the file is no journal.
+	long long replayJournal(const string& path);
+	// Loads a CSV file of "model,dealer,quantity" rows, after an optional header line of
+	// exactly those column names. The file is mapped and parsed by threads threads (0: one
+	// per core) a window at a time, the table is sized for the whole file up front and
+	// cars are placed without any incremental migration. A model may be quoted. false if
+	// the file cannot be read.
+	bool loadCsv(const string& path, CsvLoadReport& report, int threads = 0);
 
 private:
 	hash_fn    m_hash;          // hash function
+	key_hash_fn m_keyHash;      // whole-key hash function, used instead of m_hash when set
+	keymode_t  m_keyMode;       // COMPOSITEKEY mixes the dealer into m_hash(model)
 	prob_t     m_newPolicy;     // stores the change of policy request
+	vector<ModelTotals> m_modelTotals;	// quantity and cars of every model ID
+	vector<vector<uint32_t>> m_dealerIndex;	// model IDs of the cars of a dealer, at dealer - MINID; empty when off
+	long long  m_reserved;      // live cars reserve sized for, every new table holds them
+	bool       m_resizePending; // reserve or shrink_to_fit waits for the rehash in progress
 
-	Car* m_currentTable;  // hash table
-	int        m_currentCap;    // hash table size (capacity)
-	int        m_currentSize;   // current number of entries
+	ModelDict  m_models;        // model names of all stored cars, slots keep the IDs
+	SegmentedArray<unsigned int> m_modelHashes;	// m_hash of every model ID, so a key hashes without the string
+
+	CarSlot* m_currentTable;  // hash table
+	long long  m_currentCap;    // hash table size (capacity)
+	FastMod    m_currentMod;    // reduces a hash modulo m_currentCap
+	long long  m_currentSize;   // current number of entries
 	// m_currentSize includes deleted entries 
-	int        m_currNumDeleted;// number of deleted entries
+	long long  m_currNumDeleted;// number of deleted entries
 	prob_t     m_currProbing;       // collision handling policy
+	signed char* m_currentCtrl; // control bytes of a GROUPPROBE table, nullptr for other policies
 
-	Car* m_oldTable;      // hash table
-	int        m_oldCap;        // hash table size (capacity)
-	int        m_oldSize;       // current number of entries
-	int        m_oldNumDeleted; // number of deleted entries
+	CarSlot* m_oldTable;  // hash table
+	long long  m_oldCap;        // hash table size (capacity)
+	FastMod    m_oldMod;        // reduces a hash modulo m_oldCap
+	long long  m_oldSize;       // current number of entries
+	long long  m_oldNumDeleted; // number of deleted entries
 	prob_t     m_oldProbing;    // collision handling policy
+	signed char* m_oldCtrl;     // control bytes of a GROUPPROBE table, nullptr for other policies
+
+	mutable long long m_probeCount; // number of collision steps taken by all probes (read by Bench)
+	bool       m_adaptive;              // adapt picks the policy from the probe counts
+	double     m_maxAvgProbes;
+	long long  m_maxProbes;
+	mutable long long m_windowOps;      // calls, probe steps and the longest call of the window
+	mutable long long m_windowProbes;
+	mutable long long m_windowMax;
+	mutable bool m_windowMigrating;     // the window saw a migration, it judges no policy change
+	prob_t     m_adaptFrom;             // policy adapt left, NONE once the change was judged
+	double     m_adaptBaseline;         // average probe steps of the window that made adapt leave it
+	unsigned   m_adaptRejected;         // bit per policy a judged change undid, adapt does not go back to it
+	bool       m_equalHashes;
+	mutable long long m_opCount[NUM_STAT_OPS];	// the counters stats reports, see CarDBStats
+	mutable long long m_opProbes[NUM_STAT_OPS];
+	mutable long long m_probeHist[NUM_STAT_OPS][PROBE_BUCKETS];
+	mutable long long m_oldLookups;
+	mutable long long m_oldHits;
+	long long  m_migratedCars;
+	long long  m_rehashes;
+
+	// What a concurrent reader needs of one table
+	struct TableView {
+		CarSlot* m_table;               // nullptr when there is no such table
+		signed char* m_ctrl;
+		FastMod m_mod;
+		prob_t m_probing;
+	};
+	struct ReadView {
+		TableView m_current;
+		TableView m_old;
+	};
+	bool m_concurrentReads;             // getCar takes the lock-free path
+	atomic<const ReadView*> m_readView; // the tables as readers see them, replaced on every change
+	atomic<uint64_t> m_moveSeq;         // odd while a migration step moves cars between tables
+	EpochDomain m_epochs;               // frees retired tables and views once no reader holds them
+
+	long long  m_oldCursor;             // next old slot migrateStep looks at
+	long long  m_oldLive;               // cars in the old table when it was retired, for progress
+	bool       m_background;            // the worker migrates, insert and remove do not
+	bool       m_stopWorker;
+	long long  m_migrationBudget;       // old slots the worker scans per step
+	long long  m_stepBudget;            // old slots insert and remove scan, 0 for increamental_Transfer
+	chrono::microseconds m_migrationPause;	// wait of the worker between steps
+	thread     m_worker;
+	mutable recursive_mutex m_writeLock;	// held by every call in background mode and by the worker
+	unique_ptr<Journal> m_journal;      // nullptr while changes are not journalled
+	mutex m_deltaLock;                  // keeps journalled quantity deltas in the order they took effect
+	mutable unique_ptr<WorkerPool> m_scanPool;	// threads of the parallel scans, made on first use
+	CarSlot*   m_mappedTable;           // table mapped from a snapshot, released with munmap
+	size_t     m_mappedLength;
+	condition_variable_any m_migrationWake;	// the worker waits here for a rehash to start
+	mutable condition_variable_any m_migrationDone;	// signalled when the old table is dropped
 
 	//private helper functions
 	bool isPrime(int number);
-	int findNextPrime(int current);
+	static long long findNextPrime(long long current);
+	static const FastMod& capacityFor(long long current);	//first rung of the prime ladder above current
 
 	/******************************************
 	* Private function declarations go here! *
 	******************************************/
-	void Currenttable_to_oldtable();	//When the rehasing condition is met, this fln initilazies currtable to oldtable
-	bool simple_insert(Car car);		//insert without checking for reharshing (called in increamental_Transfer)
+	void Currenttable_to_oldtable(long long minLive = 0);	//When the rehasing condition is met, this fln initilazies currtable to oldtable, the new table fits at least minLive cars
+	bool simple_insert(const CarSlot& slot);	//insert without checking for reharshing (called in increamental_Transfer), reuses the cached hash
 	void increamental_Transfer();		//transfer 25% data at once
-	int getCurrentCap() const;
+	// a car was stored or removed: the model totals and the dealer index follow
+	void trackInsert(uint32_t modelId, int dealer, int quantity, unsigned int hash);
+	void trackRemove(uint32_t modelId, int dealer, int quantity, unsigned int hash);
+	const CarSlot* oldCopy(uint32_t modelId, int dealer, unsigned int hash) const;	//the key in the old table, nullptr if none
+	ModelTotals& totalsOf(uint32_t modelId);
+	CarSlot* updateSlot(string_view model, int dealer, uint32_t& modelId);	//slot of a car being updated, counted as STAT_UPDATE
+	CarSlot* deltaSlot(string_view model, int dealer, uint32_t& modelId) const;	//slot of a car for a delta, any thread
+	bool exchangeQuantity(CarSlot* slot, uint32_t modelId, int& current, int desired);	//CAS of a delta, current reloaded on failure
+	void setQuantity(CarSlot* slot, uint32_t modelId, int quantity);	//store, keep the totals and journal it
+	bool shadowed(const CarSlot& slot) const;	//an old slot whose key the current table holds as well; any thread
+	struct ScanChunk {
+		const CarSlot* m_table;
+		const signed char* m_ctrl;
+		long long m_begin;              // slots [m_begin, m_end) of the table
+		long long m_end;
+		bool m_old;
+	};
+	static int scanWorkers(int threads);	//threads of a parallel scan, 0 for one per core
+	// runs body for every chunk of both tables on the scan pool, under the writer lock
+	void forEachChunk(int threads, const function<void(int worker, const ScanChunk& chunk)>& body) const;
+	template <class Visit>
+	void scanLive(int threads, Visit visit) const {	//visit(worker, slot) for every live car
+		forEachChunk(threads, [&](int worker, const ScanChunk& chunk) {
+			for (long long block = chunk.m_begin; block < chunk.m_end; block += 64) {
+				for (uint64_t mask = occupancy(chunk.m_table, chunk.m_ctrl, chunk.m_end, block); mask != 0; mask &= mask - 1) {
+					const CarSlot& slot = chunk.m_table[block + __builtin_ctzll(mask)];
+					if (!chunk.m_old || !shadowed(slot))
+						visit(worker, slot);
+				}
+			}
+		});
+	}
+	// bit i set when slot block + i of the table is live, for the slots below capacity;
+	// capacity may be the end of a chunk
+	static uint64_t occupancy(const CarSlot* table, const signed char* ctrl, long long capacity, long long block);
+	long long getCurrentCap() const;
+	void init(int size, prob_t probing);	//shared part of the constructors
+	bool insertKey(uint32_t modelId, int dealer, int quantity);	//insert of an interned model, with the rehash checks
+	bool removeKey(uint32_t modelId, int dealer);	//remove of an interned model, with the rehash checks
+	void record(statop_t op, long long probesBefore) const;	//count a call and its probe steps, also in the adaptive window
+	void adapt();	//at the end of a window, rehash or change the policy if probing degraded
+	bool equalHashes() const;	//whether most of a sample of the current table shares its hash with another car
+	bool placeCar(uint32_t modelId, int dealer, int quantity, unsigned int hash);	//store a new key in the current table, false for a duplicate
+	static void prefetchHome(const CarSlot* table, const signed char* ctrl, const FastMod& cap, unsigned int hash);
+	uint32_t internModel(string_view model);	//model ID for a car being stored
+	uint32_t internModel(string&& model);
+	void rememberModelHash(string_view model);	//first car of a model, cache its hash under the next ID
+	CarSlot* locate(uint32_t modelId, int dealer, unsigned int hash) const;	//slot of the key in either table, nullptr if missing
+	Car toCar(const CarSlot& slot) const;	//the Car value held by a slot
+	unsigned int hashKey(uint32_t modelId, int dealer) const;	//hash of the (model, dealer) key under the key mode
+	static bool holds(const CarSlot& slot, uint32_t modelId, int dealer) {	//does the slot store this key
+		return slot.m_modelId == modelId && slot.m_dealer == dealer;
+	}
+	long long findIn(const CarSlot* table, const signed char* ctrl, const FastMod& cap, prob_t probing,
+		unsigned int hash, uint32_t modelId, int dealer) const;	//index of the key in a table, -1 if missing
+	long long scanFor(const CarSlot* table, const signed char* ctrl, const FastMod& cap, prob_t probing,
+		unsigned int hash, uint32_t modelId, int dealer) const;	//like findIn but does not stop at free buckets
+	long long groupFind(const CarSlot* table, const signed char* ctrl, const FastMod& cap,
+		unsigned int hash, uint32_t modelId, int dealer) const;	//GROUPPROBE lookup
+	long long groupClaim(signed char* ctrl, const FastMod& cap, unsigned int hash);	//GROUPPROBE slot for a new key
+	long long groupFree(const signed char* ctrl, const FastMod& cap, unsigned int hash) const;	//first empty or deleted GROUPPROBE slot
+	long long robinFind(const CarSlot* table, const FastMod& cap, unsigned int hash, uint32_t modelId, int dealer) const;	//ROBINHOOD lookup
+	void robinPlace(uint32_t modelId, int dealer, int quantity, unsigned int hash);	//ROBINHOOD insert of a new key into the current table
+	void robinErase(long long index);	//ROBINHOOD remove from the current table by backward shift
+	static long long displacement(const CarSlot& slot, long long index, const FastMod& cap);	//distance of a car from its home bucket
+	static CarSlot* newTable(long long capacity);	//zeroed slots, released with free
+	static signed char* newCtrl(long long capacity, prob_t probing);	//control bytes for a new table
+	static void setCtrl(signed char* ctrl, long long capacity, long long index, signed char value);
+	long long nextIndex(long long index, long long i, unsigned int hash, const FastMod& cap, prob_t probing) const;	//i-th probe step of a policy
+	bool migrateStep(long long budget);	//move the cars of the next budget old slots, true while old slots are left
+	void continueMigration(long long ops = 1);	//wake the worker or migrate inline, for ops operations
+	void dropOldTable();	//free an old table that has no cars left
+	void migrationWorker();
+	unique_lock<recursive_mutex> writerLock() const;	//locked in background mode only
+	void publishTables();	//readers see the current fields from now on
+	void retireTable(CarSlot* table, signed char* ctrl);	//free a table once no reader holds it
+	void releaseTable(CarSlot* table);	//free a table now, unmapping a snapshot table
+	bool loadSnapshot(int fd, const SnapshotHeader& header);	//replace the empty table by the snapshot's
+	bool loadCsv(const string& path, CsvLoadReport& report, int threads, size_t window);	//window: bytes parsed per round
+	void journal(journalop_t op, uint32_t modelId, int dealer, int quantity) {	//record a change, if journalling
+		if (m_journal != nullptr)
+			m_journal->append(op, modelId, m_models.name(modelId), dealer, quantity);
+	}
+	Car readCar(string_view model, int dealer) const;	//getCar of the concurrent read mode
+	bool readIn(const TableView& view, bool old, unsigned int hash, uint32_t modelId, int dealer, CarSlot& found, long long* at = nullptr) const;
 };
 #endif
\ No newline at end of file
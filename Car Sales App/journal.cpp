@@ -0,0 +1,281 @@
+// CMSC 341 - Fall 2023 - Project 4
+// Write-ahead journal of CarDB changes
+//
+// File layout, numbers in the byte order of the writer:
+//
+//   header           "CARDBJNL", uint32 version, uint32 byte order mark
+//   groups           uint32 payload length, uint32 CRC-32 of the payload, payload
+//
+// A payload is a run of records, each starting with its journalop_t byte:
+//
+//   JOURNAL_MODEL    uint32 model ID, uint32 name length, name
+//   JOURNAL_INSERT   uint32 model ID, int32 dealer, int32 quantity
+//   JOURNAL_REMOVE   uint32 model ID, int32 dealer
+//   JOURNAL_UPDATE   uint32 model ID, int32 dealer, int32 quantity
+//   JOURNAL_SESSION  nothing; the model IDs bound so far are forgotten
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "journal.h"
+
+static const char JOURNAL_MAGIC[8] = { 'C', 'A', 'R', 'D', 'B', 'J', 'N', 'L' };
+static const uint32_t JOURNAL_VERSION = 1;
+static const uint32_t JOURNAL_BYTE_ORDER = 0x01020304;
+static const size_t JOURNAL_HEADER = sizeof(JOURNAL_MAGIC) + 2 * sizeof(uint32_t);
+static const size_t GROUP_HEADER = 2 * sizeof(uint32_t);
+
+// CRC-32 (IEEE 802.3), table driven
+static uint32_t crc32(const char* data, size_t length) {
+	static const struct Table {
+		uint32_t m_entries[256];
+		Table() {
+			for (uint32_t i = 0; i < 256; i++) {
+				uint32_t crc = i;
+				for (int bit = 0; bit < 8; bit++)
+					crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+				m_entries[i] = crc;
+			}
+		}
+	} table;
+	uint32_t crc = 0xFFFFFFFFu;
+	for (size_t i = 0; i < length; i++)
+		crc = table.m_entries[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ (crc >> 8);
+	return crc ^ 0xFFFFFFFFu;
+}
+
+template <class T>
+static void put(vector<char>& buffer, T value) {
+	const char* bytes = reinterpret_cast<const char*>(&value);
+	buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+}
+
+template <class T>
+static bool get(const char*& cursor, const char* end, T& value) {
+	if (static_cast<size_t>(end - cursor) < sizeof(T))
+		return false;
+	memcpy(&value, cursor, sizeof(T));
+	cursor += sizeof(T);
+	return true;
+}
+
+static bool writeAll(int fd, const char* data, size_t length) {
+	while (length > 0) {
+		ssize_t written = write(fd, data, length);
+		if (written <= 0)
+			return false;
+		data += written;
+		length -= static_cast<size_t>(written);
+	}
+	return true;
+}
+
+Journal::Journal() : m_fd(-1), m_interval(0), m_groups(0), m_stop(false) {}
+
+Journal::~Journal() {
+	close();
+}
+
+bool Journal::open(const string& path, chrono::microseconds interval) {
+	close();
+	int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return false;
+	long long length = scan(fd, [](const char*, size_t) {});
+	if (length < 0) {
+		// an empty file becomes a journal, anything else is left alone
+		struct stat info;
+		if (fstat(fd, &info) != 0 || info.st_size != 0) {
+			::close(fd);
+			return false;
+		}
+		vector<char> header(JOURNAL_MAGIC, JOURNAL_MAGIC + sizeof(JOURNAL_MAGIC));
+		put(header, JOURNAL_VERSION);
+		put(header, JOURNAL_BYTE_ORDER);
+		if (!writeAll(fd, header.data(), header.size())) {
+			::close(fd);
+			return false;
+		}
+		length = JOURNAL_HEADER;
+	}
+	// a torn group at the end would hide every group appended after it
+	if (ftruncate(fd, length) != 0 || lseek(fd, length, SEEK_SET) != length) {
+		::close(fd);
+		return false;
+	}
+	m_fd = fd;
+	m_interval = interval;
+	m_groups = 0;
+	m_stop = false;
+	m_defined.clear();
+	m_buffer.clear();
+	// the model IDs of an earlier session belonged to another CarDB
+	m_buffer.push_back(static_cast<char>(JOURNAL_SESSION));
+	if (m_interval.count() > 0)
+		m_flusher = thread(&Journal::flusherLoop, this);
+	else
+		flush();
+	return true;
+}
+
+void Journal::close() {
+	if (m_flusher.joinable()) {
+		{
+			lock_guard<mutex> lock(m_lock);
+			m_stop = true;
+		}
+		m_wake.notify_one();
+		m_flusher.join();
+	}
+	if (m_fd >= 0) {
+		flush();
+		::close(m_fd);
+		m_fd = -1;
+	}
+}
+
+void Journal::append(journalop_t op, uint32_t modelId, string_view name, int dealer, int quantity) {
+	{
+		lock_guard<mutex> lock(m_lock);
+		if (modelId >= m_defined.size())
+			m_defined.resize(modelId + 1, false);
+		if (!m_defined[modelId]) {
+			m_defined[modelId] = true;
+			m_buffer.push_back(static_cast<char>(JOURNAL_MODEL));
+			put(m_buffer, modelId);
+			put(m_buffer, static_cast<uint32_t>(name.size()));
+			m_buffer.insert(m_buffer.end(), name.begin(), name.end());
+		}
+		m_buffer.push_back(static_cast<char>(op));
+		put(m_buffer, modelId);
+		put(m_buffer, static_cast<int32_t>(dealer));
+		if (op != JOURNAL_REMOVE)
+			put(m_buffer, static_cast<int32_t>(quantity));
+	}
+	if (m_interval.count() == 0)
+		flush();
+}
+
+void Journal::sync() {
+	flush();
+}
+
+void Journal::truncate() {
+	lock_guard<mutex> file(m_fileLock);
+	lock_guard<mutex> lock(m_lock);
+	if (m_fd < 0)
+		return;
+	m_buffer.clear();
+	m_defined.clear();
+	m_buffer.push_back(static_cast<char>(JOURNAL_SESSION));
+	if (ftruncate(m_fd, JOURNAL_HEADER) == 0 && lseek(m_fd, JOURNAL_HEADER, SEEK_SET) == static_cast<off_t>(JOURNAL_HEADER))
+		fdatasync(m_fd);
+}
+
+long long Journal::groups() const {
+	lock_guard<mutex> lock(m_lock);
+	return m_groups;
+}
+
+void Journal::flush() {
+	lock_guard<mutex> file(m_fileLock);
+	vector<char> group;
+	{
+		lock_guard<mutex> lock(m_lock);
+		if (m_buffer.empty() || m_fd < 0)
+			return;
+		// the records leave the buffer, appends carry on while the group is written
+		group.reserve(GROUP_HEADER + m_buffer.size());
+		put(group, static_cast<uint32_t>(m_buffer.size()));
+		put(group, crc32(m_buffer.data(), m_buffer.size()));
+		group.insert(group.end(), m_buffer.begin(), m_buffer.end());
+		m_buffer.clear();
+		m_groups++;
+	}
+	if (writeAll(m_fd, group.data(), group.size()))
+		fdatasync(m_fd);
+}
+
+void Journal::flusherLoop() {
+	unique_lock<mutex> lock(m_lock);
+	while (!m_stop) {
+		m_wake.wait_for(lock, m_interval, [this]() { return m_stop; });
+		lock.unlock();
+		flush();
+		lock.lock();
+	}
+}
+
+long long Journal::scan(int fd, const function<void(const char* payload, size_t length)>& group) {
+	struct stat info;
+	if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < JOURNAL_HEADER)
+		return -1;
+	vector<char> file(info.st_size);
+	if (pread(fd, file.data(), file.size(), 0) != static_cast<ssize_t>(file.size()))
+		return -1;
+	const char* cursor = file.data();
+	const char* end = cursor + file.size();
+	uint32_t version = 0, byteOrder = 0;
+	if (memcmp(cursor, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0)
+		return -1;
+	cursor += sizeof(JOURNAL_MAGIC);
+	if (!get(cursor, end, version) || !get(cursor, end, byteOrder) || version != JOURNAL_VERSION || byteOrder != JOURNAL_BYTE_ORDER)
+		return -1;
+	for (;;) {
+		const char* start = cursor;
+		uint32_t length = 0, checksum = 0;
+		if (!get(cursor, end, length) || !get(cursor, end, checksum)
+			|| static_cast<size_t>(end - cursor) < length || crc32(cursor, length) != checksum)
+			return start - file.data();
+		group(cursor, length);
+		cursor += length;
+	}
+}
+
+long long Journal::replay(const string& path, const function<void(journalop_t op, const string& model, int dealer, int quantity)>& apply) {
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return -1;
+	long long operations = 0;
+	bool intact = true;
+	vector<string> models;
+	long long length = scan(fd, [&](const char* payload, size_t size) {
+		const char* cursor = payload;
+		const char* end = payload + size;
+		while (intact && cursor < end) {
+			journalop_t op = static_cast<journalop_t>(*cursor++);
+			uint32_t modelId = 0;
+			int32_t dealer = 0, quantity = 0;
+			if (op == JOURNAL_SESSION) {
+				models.clear();
+				continue;
+			}
+			if (!get(cursor, end, modelId)) {
+				intact = false;
+				break;
+			}
+			if (op == JOURNAL_MODEL) {
+				uint32_t nameLength = 0;
+				if (!get(cursor, end, nameLength) || static_cast<size_t>(end - cursor) < nameLength) {
+					intact = false;
+					break;
+				}
+				if (modelId >= models.size())
+					models.resize(modelId + 1);
+				models[modelId].assign(cursor, nameLength);
+				cursor += nameLength;
+				continue;
+			}
+			// a group that passed its checksum but does not parse was written by something else
+			intact = (op == JOURNAL_INSERT || op == JOURNAL_REMOVE || op == JOURNAL_UPDATE)
+				&& modelId < models.size() && get(cursor, end, dealer)
+				&& (op == JOURNAL_REMOVE || get(cursor, end, quantity));
+			if (!intact)
+				break;
+			apply(op, models[modelId], dealer, quantity);
+			operations++;
+		}
+	});
+	::close(fd);
+	return (length < 0) ? -1 : operations;
+}
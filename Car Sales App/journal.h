@@ -0,0 +1,61 @@
+// CMSC 341 - Fall 2023 - Project 4
+#ifndef JOURNAL_H
+#define JOURNAL_H
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+using namespace std;
+
+// Operations recorded in a journal
+enum journalop_t { JOURNAL_MODEL = 1, JOURNAL_INSERT, JOURNAL_REMOVE, JOURNAL_UPDATE, JOURNAL_SESSION };
+
+// An append-only write-ahead journal of CarDB changes. Records are collected in a
+// buffer and written as one checksummed group, followed by one fdatasync, every
+// interval by a flusher thread (group commit), or at once for an interval of 0.
+// A model name is written once per session as a JOURNAL_MODEL record that binds it
+// to the model ID of the writing CarDB; later records carry only the ID.
+class Journal {
+public:
+	friend class Tester;
+	Journal();
+	~Journal();	// writes what is buffered
+	Journal(const Journal&) = delete;
+	Journal& operator=(const Journal&) = delete;
+	// opens or creates the file; a torn last group is cut off and a new session starts
+	bool open(const string& path, chrono::microseconds interval);
+	void close();
+	bool isOpen() const { return m_fd >= 0; }
+	// quantity is ignored for JOURNAL_REMOVE; name is only read the first time an ID is seen
+	void append(journalop_t op, uint32_t modelId, string_view name, int dealer, int quantity);
+	void sync();	// returns once every appended record is on disk
+	void truncate();	// drops every record, once a snapshot holds their effects
+	long long groups() const;	// groups written so far, each with one fdatasync
+
+	// Reads the records of a journal file in order, with model names resolved; stops
+	// at the first torn or damaged group. Returns the operations read, -1 if the file
+	// is no journal.
+	static long long replay(const string& path, const function<void(journalop_t op, const string& model, int dealer, int quantity)>& apply);
+private:
+	int m_fd;
+	chrono::microseconds m_interval;
+	mutable mutex m_lock;           // guards the buffer and the defined IDs
+	mutex m_fileLock;               // keeps the groups in order on the file
+	vector<char> m_buffer;          // records not written yet
+	vector<bool> m_defined;         // model IDs already bound in this session
+	long long m_groups;
+	bool m_stop;
+	condition_variable m_wake;
+	thread m_flusher;
+
+	void flush();	// write the buffer as one group and sync it
+	void flusherLoop();
+	// valid length of a journal, -1 for no journal; calls group for the payload of every intact group
+	static long long scan(int fd, const function<void(const char* payload, size_t length)>& group);
+};
+#endif
@@ -0,0 +1,283 @@
+// CMSC 341 - Fall 2023 - Project 4
+// Bulk loading of CSV inventory files
+//
+// A file is mapped and read a window at a time. Every window is cut at line ends into
+// one chunk per thread; the threads parse their rows and look up and hash the models
+// already known, then the calling thread interns the new models and places the rows
+// in file order, so the result is the one of inserting the rows one by one. Rows are
+// "model,dealer,quantity"; spaces around a field are ignored and a model may be
+// quoted, so it may hold commas, line breaks, and quotes written twice as in RFC 4180.
+// A row ends at the first line break after an even number of quotes, so a stray quote
+// joins the lines up to the next quote into one rejected row.
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include "dealer.h"
+
+// bytes parsed per round, a few rows of them are in flight per thread
+static const size_t CSV_WINDOW = 16 << 20;
+// rows ahead whose home bucket is prefetched while placing
+static const size_t CSV_PREFETCH = 8;
+
+enum csvrow_t { CSV_ROW, CSV_BLANK, CSV_BAD };
+
+struct CsvRow {
+	string_view m_model;
+	int m_dealer;
+	int m_quantity;
+	uint32_t m_modelId;         // 0 until the model is interned
+	unsigned int m_hash;
+	bool m_valid;               // false for a rejected row
+};
+
+static string_view trim(string_view field) {
+	while (!field.empty() && (field.front() == ' ' || field.front() == '\t'))
+		field.remove_prefix(1);
+	while (!field.empty() && (field.back() == ' ' || field.back() == '\t' || field.back() == '\r' || field.back() == '\n'))
+		field.remove_suffix(1);
+	return field;
+}
+
+static bool parseInt(string_view field, int& value) {
+	field = trim(field);
+	if (!field.empty() && field.front() == '+')
+		field.remove_prefix(1);
+	from_chars_result result = from_chars(field.data(), field.data() + field.size(), value);
+	return !field.empty() && result.ec == errc() && result.ptr == field.data() + field.size();
+}
+
+// a model with doubled quotes is unescaped into names, which keeps it for the row
+static csvrow_t parseRow(string_view line, CsvRow& row, deque<string>& names) {
+	line = trim(line);
+	if (line.empty())
+		return CSV_BLANK;
+	// a quoted model may hold commas, the field ends at the first quote that is not doubled
+	size_t first = 0;
+	if (line.front() == '"') {
+		bool escaped = false;
+		size_t close = line.find('"', 1);
+		while (close != string_view::npos && close + 1 < line.size() && line[close + 1] == '"') {
+			escaped = true;
+			close = line.find('"', close + 2);
+		}
+		if (close == string_view::npos)
+			return CSV_BAD;
+		row.m_model = line.substr(1, close - 1);
+		if (escaped) {
+			string name;
+			for (size_t i = 0; i < row.m_model.size(); i++) {
+				name += row.m_model[i];
+				if (row.m_model[i] == '"')
+					i++;
+			}
+			names.push_back(std::move(name));
+			row.m_model = names.back();
+		}
+		first = line.find_first_not_of(" \t", close + 1);
+		if (first == string_view::npos || line[first] != ',')
+			return CSV_BAD;
+	}
+	else {
+		first = line.find(',');
+		if (first == string_view::npos)
+			return CSV_BAD;
+		row.m_model = trim(line.substr(0, first));
+		if (row.m_model.find('"') != string_view::npos)
+			return CSV_BAD;
+	}
+	size_t second = line.find(',', first + 1);
+	if (second == string_view::npos || line.find(',', second + 1) != string_view::npos)
+		return CSV_BAD;
+	row.m_modelId = 0;
+	row.m_hash = 0;
+	if (!parseInt(line.substr(first + 1, second - first - 1), row.m_dealer)
+		|| !parseInt(line.substr(second + 1), row.m_quantity))
+		return CSV_BAD;
+	return CSV_ROW;
+}
+
+// a "model,dealer,quantity" line naming the columns, spaces and case aside
+static bool isHeader(string_view line) {
+	static const char* const COLUMNS[] = { "model", "dealer", "quantity" };
+	line = trim(line);
+	for (int column = 0; column < 3; column++) {
+		size_t comma = (column < 2) ? line.find(',') : line.size();
+		if (comma == string_view::npos)
+			return false;
+		string_view field = trim(line.substr(0, comma));
+		if (field.size() != strlen(COLUMNS[column])
+			|| !equal(field.begin(), field.end(), COLUMNS[column], [](char a, char b) { return tolower(static_cast<unsigned char>(a)) == b; }))
+			return false;
+		line.remove_prefix(min(comma + 1, line.size()));
+	}
+	return true;
+}
+
+// start of the row after the one holding position, or end; from is the start of a row at
+// or before position, the quotes from there tell whether a line break is inside a model
+static const char* nextRow(const char* from, const char* position, const char* end) {
+	size_t quotes = count(from, position, '"');
+	for (;;) {
+		const char* newline = static_cast<const char*>(memchr(position, '\n', end - position));
+		if (newline == nullptr)
+			return end;
+		quotes += count(position, newline, '"');
+		if (quotes % 2 == 0)
+			return newline + 1;
+		position = newline + 1;
+	}
+}
+
+bool CarDB::loadCsv(const string& path, CsvLoadReport& report, int threads) {
+	return loadCsv(path, report, threads, CSV_WINDOW);
+}
+
+bool CarDB::loadCsv(const string& path, CsvLoadReport& report, int threads, size_t window) {
+	report = CsvLoadReport{ 0, 0, 0, 0, 0 };
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat info;
+	if (fstat(fd, &info) != 0) {
+		close(fd);
+		return false;
+	}
+	size_t length = static_cast<size_t>(info.st_size);
+	const char* data = nullptr;
+	if (length > 0) {
+		void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapped == MAP_FAILED) {
+			close(fd);
+			return false;
+		}
+		data = static_cast<const char*>(mapped);
+		madvise(mapped, length, MADV_SEQUENTIAL);
+	}
+	close(fd);
+	if (threads <= 0)
+		threads = max(1u, thread::hardware_concurrency());
+	window = max<size_t>(window, 1);
+	const char* end = data + length;
+
+	// a first line naming the columns is skipped, any other bad first line is a rejected row
+	const char* cursor = data;
+	if (length > 0 && isHeader(string_view(data, nextRow(data, data, end) - data)))
+		cursor = nextRow(data, data, end);
+
+	// the lines of the file bound the new cars, counted in parallel
+	vector<long long> lines(threads, 0);
+	vector<thread> workers;
+	size_t share = (end - cursor) / threads + 1;
+	for (int t = 0; t < threads; t++) {
+		workers.emplace_back([&, t]() {
+			const char* from = cursor + min(share * t, static_cast<size_t>(end - cursor));
+			const char* to = cursor + min(share * (t + 1), static_cast<size_t>(end - cursor));
+			long long count = 0;
+			for (const char* p = from; (p = static_cast<const char*>(memchr(p, '\n', to - p))) != nullptr; p++)
+				count++;
+			lines[t] = count;
+		});
+	}
+	for (thread& worker : workers)
+		worker.join();
+	long long rows = (cursor < end && end[-1] != '\n') ? 1 : 0;
+	for (long long count : lines)
+		rows += count;
+
+	unique_lock<recursive_mutex> lock = writerLock();
+	// one table for the whole file, built before the first row and fully migrated, so
+	// neither a rehash nor an incremental step runs while the rows are placed
+	if ((m_currentSize + m_currNumDeleted + rows) > 0.5 * m_currentCap || m_newPolicy != NONE) {
+		while (m_oldTable != NULL)
+			migrateStep(m_oldCap);
+		Currenttable_to_oldtable(m_currentSize - m_currNumDeleted + rows);
+	}
+	while (m_oldTable != NULL)
+		migrateStep(m_oldCap);
+
+	vector<vector<CsvRow>> parsed(threads);
+	vector<deque<string>> unescaped(threads);	// the models with quotes of the window, per thread
+	vector<const char*> bounds(threads + 1);
+	while (cursor < end) {
+		const char* stop = (static_cast<size_t>(end - cursor) <= window) ? end : nextRow(cursor, cursor + window - 1, end);
+		bounds[0] = cursor;
+		for (int t = 1; t < threads; t++) {
+			const char* split = cursor + (stop - cursor) * t / threads;
+			bounds[t] = (split <= bounds[t - 1]) ? bounds[t - 1] : nextRow(bounds[t - 1], split - 1, stop);
+		}
+		bounds[threads] = stop;
+
+		// parse, and find and hash the models the table already knows
+		workers.clear();
+		for (int t = 0; t < threads; t++) {
+			workers.emplace_back([&, t]() {
+				vector<CsvRow>& out = parsed[t];
+				out.clear();
+				unescaped[t].clear();
+				for (const char* line = bounds[t]; line < bounds[t + 1]; ) {
+					const char* next = nextRow(line, line, bounds[t + 1]);
+					CsvRow row;
+					csvrow_t kind = parseRow(string_view(line, next - line), row, unescaped[t]);
+					line = next;
+					if (kind == CSV_BLANK)
+						continue;
+					// insert turns EMPTY away as well
+					row.m_valid = kind == CSV_ROW && !(row.m_model.empty() && row.m_dealer == 0);
+					if (row.m_valid) {
+						row.m_modelId = m_models.find(row.m_model);
+						if (row.m_modelId != 0)
+							row.m_hash = hashKey(row.m_modelId, row.m_dealer);
+					}
+					out.push_back(row);
+				}
+			});
+		}
+		for (thread& worker : workers)
+			worker.join();
+
+		// place in file order, the models seen for the first time are interned here
+		for (int t = 0; t < threads; t++) {
+			vector<CsvRow>& chunk = parsed[t];
+			for (size_t k = 0; k < chunk.size(); k++) {
+				CsvRow& row = chunk[k];
+				if (row.m_valid && row.m_modelId == 0) {
+					row.m_modelId = internModel(row.m_model);
+					row.m_hash = hashKey(row.m_modelId, row.m_dealer);
+				}
+			}
+			for (size_t k = 0; k < chunk.size(); k++) {
+				const CsvRow& row = chunk[k];
+				report.m_rows++;
+				if (k + CSV_PREFETCH < chunk.size() && chunk[k + CSV_PREFETCH].m_valid)
+					prefetchHome(m_currentTable, m_currentCtrl, m_currentMod, chunk[k + CSV_PREFETCH].m_hash);
+				if (!row.m_valid) {
+					report.m_rejected++;
+					continue;
+				}
+				long long before = m_probeCount;
+				if (placeCar(row.m_modelId, row.m_dealer, row.m_quantity, row.m_hash)) {
+					journal(JOURNAL_INSERT, row.m_modelId, row.m_dealer, row.m_quantity);
+					report.m_inserted++;
+				}
+				else
+					report.m_duplicates++;
+				record(STAT_INSERT, before);
+			}
+		}
+		cursor = stop;
+	}
+	if (data != nullptr)
+		munmap(const_cast<char*>(data), length);
+	adapt();
+	report.m_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	return true;
+}
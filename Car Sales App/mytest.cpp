@@ -3,8 +3,27 @@
 #include <cassert>
 #include <random>
 #include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <atomic>
+#include <thread>
+#include <fstream>
+#include <map>
+#include <climits>
 
 #include "dealer.h"  // Include the header file for your CarDB class
+#include "sharded.h"
+
+// counts heap allocations, so a test can check that a call does not allocate
+static atomic<long long> allocationCount(0);
+void* operator new(size_t size) {
+	allocationCount++;
+	if (void* p = malloc(size == 0 ? 1 : size))
+		return p;
+	throw bad_alloc();
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
 
 enum RANDOM { UNIFORMINT, UNIFORMREAL, NORMAL, SHUFFLE };
 class Random {
@@ -113,6 +132,9 @@ unsigned int hashCode(const string str) {
 		val = val * thirtyThree + str[i];
 	return val;
 }
+unsigned int keyHashCode(const string& model, int dealer) {
+	return hashCode(model) * 31 + dealer;
+}
 string carModels[5] = { "challenger", "stratos", "gt500", "miura", "x101" };
 string dealers[5] = { "super car", "mega car", "car world", "car joint", "shack of cars" };
 
@@ -135,7 +157,7 @@ public:
 
 		for (Car car : cars_inserted) {
 			int index = hashCode(car.getModel()) % carDB.m_currentCap;
-			if (!(carDB.m_currentTable[index] == car)) {
+			if (!(carDB.toCar(carDB.m_currentTable[index]) == car)) {
 				return 0;
 			}
 		}
@@ -206,8 +228,8 @@ public:
 		}
 
 		// Check if the cars are in the expected positions
-		if (!(carDB.m_currentTable[index1] == car1) || !(carDB.m_currentTable[81] == car2) ||
-			!(carDB.m_currentTable[index3] == car3) || !(carDB.m_currentTable[1] == car4)) {
+		if (!(carDB.toCar(carDB.m_currentTable[index1]) == car1) || !(carDB.toCar(carDB.m_currentTable[81]) == car2) ||
+			!(carDB.toCar(carDB.m_currentTable[index3]) == car3) || !(carDB.toCar(carDB.m_currentTable[1]) == car4)) {
 			return false;
 		}
 
@@ -240,8 +262,8 @@ public:
 		}
 
 		// Check if the cars are in the expected positions
-		if (!(carDB.m_currentTable[index1] == car1) || !(carDB.m_currentTable[73] == car2) ||
-			!(carDB.m_currentTable[index3] == car3) || !(carDB.m_currentTable[98] == car4)) {
+		if (!(carDB.toCar(carDB.m_currentTable[index1]) == car1) || !(carDB.toCar(carDB.m_currentTable[73]) == car2) ||
+			!(carDB.toCar(carDB.m_currentTable[index3]) == car3) || !(carDB.toCar(carDB.m_currentTable[98]) == car4)) {
 			return false;
 		}
 
@@ -275,8 +297,8 @@ public:
 		}
 
 		// Check if the cars are in the expected positions
-		if (!(carDB.m_currentTable[index1] == car1) || !(carDB.m_currentTable[index2] == car2) ||
-			!(carDB.m_currentTable[index3] == car3) || !(carDB.m_currentTable[index4] == car4)) {
+		if (!(carDB.toCar(carDB.m_currentTable[index1]) == car1) || !(carDB.toCar(carDB.m_currentTable[index2]) == car2) ||
+			!(carDB.toCar(carDB.m_currentTable[index3]) == car3) || !(carDB.toCar(carDB.m_currentTable[index4]) == car4)) {
 			return false;
 		}
 
@@ -515,6 +537,1208 @@ public:
 		return 1;
 	}
 
+	bool testCompositeKey_SameModelManyDealers() {
+		// every car has the same model, only the dealer tells them apart
+		CarDB modelKeyed(MINPRIME, hashCode, QUADRATIC);
+		CarDB composite(MINPRIME, hashCode, QUADRATIC, COMPOSITEKEY);
+		for (int dealer = MINID; dealer < MINID + 40; dealer++) {
+			Car car("challenger", 1, dealer, true);
+			if (!modelKeyed.insert(car) || !composite.insert(car))
+				return 0;
+		}
+		for (int dealer = MINID; dealer < MINID + 40; dealer++) {
+			if (!(composite.getCar("challenger", dealer) == Car("challenger", 0, dealer)))
+				return 0;
+		}
+		// the composite hash spreads the dealers, the model-only hash chains them
+		return composite.m_probeCount * 4 < modelKeyed.m_probeCount;
+	}
+	bool testCompositeKey_KeyHashFunction() {
+		CarDB carDB(MINPRIME, keyHashCode, DOUBLEHASH);
+		Car car1("gt500", 3, 1003, true);
+		Car car2("gt500", 4, 1004, true);
+		carDB.insert(car1);
+		carDB.insert(car2);
+		// each car sits at the home bucket of its whole key
+		if (!(carDB.toCar(carDB.m_currentTable[keyHashCode("gt500", 1003) % carDB.m_currentCap]) == car1) ||
+			!(carDB.toCar(carDB.m_currentTable[keyHashCode("gt500", 1004) % carDB.m_currentCap]) == car2))
+			return 0;
+		if (!carDB.remove(car1) || carDB.getCar("gt500", 1003).getUsed())
+			return 0;
+		return carDB.updateQuantity(car2, 9) && carDB.getCar("gt500", 1004).getQuantity() == 9;
+	}
+
+	bool testFastMod_MatchesModulo() {
+		Random rndPrime(0, 97);
+		std::mt19937_64 rndValue(10);
+		for (int i = 0; i < 1000; i++) {
+			long long prime = CarDB::findNextPrime(rndPrime.getRandNum() * 50000000LL);
+			const FastMod& mod = CarDB::capacityFor(prime - 1);
+			uint64_t value = rndValue();
+			if (mod.m_divisor != static_cast<uint64_t>(prime) || mod.mod(value) != value % prime)
+				return 0;
+		}
+		return 1;
+	}
+	bool testRehash_GrowsPastMAXPRIME() {
+		// the table used to stop growing at MAXPRIME, here it has to hold more cars than that
+		CarDB carDB(MINPRIME, hashCode, DOUBLEHASH, COMPOSITEKEY);
+		const int numCars = 120000;
+		for (int i = 0; i < numCars; i++) {
+			Car car(carModels[i % 5], 1, MINID + i / 5 % (MAXID - MINID + 1), true);
+			car.setModel(car.getModel() + to_string(i / 5 / (MAXID - MINID + 1)));
+			if (!carDB.insert(car))
+				return 0;
+		}
+		if (carDB.m_currentCap <= MAXPRIME || carDB.lambda() > 0.5)
+			return 0;
+		for (int i = 0; i < numCars; i += 997) {
+			string model = carModels[i % 5] + to_string(i / 5 / (MAXID - MINID + 1));
+			if (!carDB.getCar(model, MINID + i / 5 % (MAXID - MINID + 1)).getUsed())
+				return 0;
+		}
+		return 1;
+	}
+
+	bool testCachedHash_SurvivesRehash() {
+		// every live slot keeps the hash of its key, also after being moved by the rehash
+		CarDB carDB(MINPRIME, hashCode, QUADRATIC, COMPOSITEKEY);
+		Random rndID(MINID, MAXID);
+		Random rndCar(0, 4);
+		for (int i = 0; i < 200; ++i)
+			carDB.insert(Car(carModels[rndCar.getRandNum()], 1, rndID.getRandNum(), true));
+		if (carDB.m_currentCap == MINPRIME)
+			return 0;
+		for (long long i = 0; i < carDB.m_currentCap; i++) {
+			const CarSlot& slot = carDB.m_currentTable[i];
+			if (slot.getUsed() && slot.m_hashCode != carDB.hashKey(slot.getModelId(), slot.getDealer()))
+				return 0;
+		}
+		return 1;
+	}
+
+	bool testGroupProbe_InsertFindRemove() {
+		CarDB carDB(MINPRIME, hashCode, GROUPPROBE);
+		Random rndID(MINID, MAXID);
+		Random rndCar(0, 4);
+		Random rndQuantity(0, 50);
+		vector<Car> cars_inserted;
+		// enough cars to trigger several rehashes
+		for (int i = 0; i < 300; ++i) {
+			Car car(carModels[rndCar.getRandNum()], rndQuantity.getRandNum(), rndID.getRandNum(), true);
+			if (carDB.insert(car))
+				cars_inserted.push_back(car);
+			else if (!carDB.getCar(car.getModel(), car.getDealer()).getUsed())
+				return 0;	//rejected although it is not a duplicate
+		}
+		for (const Car& car : cars_inserted) {
+			if (!(carDB.getCar(car.getModel(), car.getDealer()) == car))
+				return 0;
+		}
+		// the control byte of every live slot carries the tag of its hash
+		for (long long i = 0; i < carDB.m_currentCap; i++) {
+			if (carDB.m_currentTable[i].getUsed() != (carDB.m_currentCtrl[i] >= 0))
+				return 0;
+		}
+		// remove every other car, the rest must stay reachable past the tombstones
+		for (size_t i = 0; i < cars_inserted.size(); i += 2) {
+			if (!carDB.remove(cars_inserted[i]))
+				return 0;
+		}
+		for (size_t i = 0; i < cars_inserted.size(); i++) {
+			bool found = carDB.getCar(cars_inserted[i].getModel(), cars_inserted[i].getDealer()).getUsed();
+			if (found != (i % 2 == 1))
+				return 0;
+		}
+		return 1;
+	}
+	bool testGroupProbe_CollidingKeys() {
+		// all cars share a model, so every key has the same home slot and tag
+		CarDB carDB(MINPRIME, hashCode, GROUPPROBE);
+		for (int dealer = MINID; dealer < MINID + 45; dealer++)
+			carDB.insert(Car("challenger", 1, dealer, true));
+		Car car1("challenger", 1, MINID, true);
+		Car car2("challenger", 1, MINID + 44, true);
+		if (!carDB.remove(car1) || carDB.getCar("challenger", MINID).getUsed())
+			return 0;
+		if (!carDB.updateQuantity(car2, 7) || carDB.getCar("challenger", MINID + 44).getQuantity() != 7)
+			return 0;
+		return !carDB.insert(car2) && carDB.insert(car1);
+	}
+
+	bool testRobinHood_ChurnLeavesNoTombstones() {
+		CarDB carDB(MINPRIME, hashCode, ROBINHOOD, COMPOSITEKEY);
+		for (int dealer = MINID; dealer < MINID + 500; dealer++)
+			carDB.insert(Car(carModels[dealer % 5], 1, dealer, true));
+		carDB.waitForMigration();
+		long long rehashes = carDB.stats().m_rehashes;
+		// sell and restock at a steady size: no deleted buckets, so no rehash either
+		for (int dealer = MINID; dealer < MINID + 4000; dealer++) {
+			if (!carDB.remove(Car(carModels[dealer % 5], 0, dealer, true)))
+				return 0;
+			if (!carDB.insert(Car(carModels[dealer % 5], 2, dealer + 500, true)))
+				return 0;
+		}
+		if (carDB.m_currNumDeleted != 0 || carDB.stats().m_rehashes != rehashes || carDB.m_currentSize != 500)
+			return 0;
+		// along every chain the distance from home grows by at most one per bucket
+		for (long long i = 0; i < carDB.m_currentCap; i++) {
+			long long next = (i + 1) % carDB.m_currentCap;
+			const CarSlot& slot = carDB.m_currentTable[next];
+			if (slot.getUsed() && CarDB::displacement(slot, next, carDB.m_currentMod) > 0
+				&& (!carDB.m_currentTable[i].getUsed()
+					|| CarDB::displacement(slot, next, carDB.m_currentMod) > CarDB::displacement(carDB.m_currentTable[i], i, carDB.m_currentMod) + 1))
+				return 0;
+		}
+		for (int dealer = MINID; dealer < MINID + 4500; dealer++) {
+			if (carDB.getCar(carModels[dealer % 5], dealer).getUsed() != (dealer >= MINID + 4000))
+				return 0;
+		}
+		return 1;
+	}
+
+	bool testRobinHood_CollidingKeys() {
+		// one model, so every key has the same home bucket
+		CarDB carDB(MINPRIME, hashCode, ROBINHOOD);
+		for (int dealer = MINID; dealer < MINID + 45; dealer++)
+			carDB.insert(Car("challenger", 1, dealer, true));
+		Car car1("challenger", 1, MINID, true);
+		Car car2("challenger", 1, MINID + 44, true);
+		// unlike the lazy delete policies, removing the head of the chain keeps the rest reachable
+		if (!carDB.remove(car1) || carDB.getCar("challenger", MINID).getUsed())
+			return 0;
+		if (!carDB.updateQuantity(car2, 7) || carDB.getCar("challenger", MINID + 44).getQuantity() != 7)
+			return 0;
+		return !carDB.insert(car2) && carDB.insert(car1) && carDB.m_currNumDeleted == 0;
+	}
+
+	bool testModelDict_InternsEveryModelOnce() {
+		CarDB carDB(MINPRIME, hashCode, QUADRATIC);
+		Random rndID(MINID, MAXID);
+		Random rndCar(0, 4);
+		for (int i = 0; i < 100; ++i)
+			carDB.insert(Car(carModels[rndCar.getRandNum()], 1, rndID.getRandNum(), true));
+		// five models plus the reserved empty name
+		if (carDB.m_models.size() != 6)
+			return 0;
+		// lookups of unknown models must not grow the dictionary
+		if (carDB.getCar("nonexistent", MINID).getUsed() || carDB.remove(Car("nonexistent", 0, MINID, true)))
+			return 0;
+		if (carDB.m_models.find("nonexistent") != 0 || carDB.m_models.size() != 6)
+			return 0;
+		// every live slot refers to the name its car was inserted with
+		for (long long i = 0; i < carDB.m_currentCap; i++) {
+			const CarSlot& slot = carDB.m_currentTable[i];
+			if (slot.getUsed() && carDB.m_models.find(carDB.m_models.name(slot.getModelId())) != slot.getModelId())
+				return 0;
+		}
+		return sizeof(CarSlot) < sizeof(Car);
+	}
+
+	bool testBatch_MatchesSingleCalls() {
+		prob_t policies[] = { QUADRATIC, DOUBLEHASH, GROUPPROBE, ROBINHOOD };
+		for (prob_t policy : policies) {
+			CarDB carDB(MINPRIME, hashCode, policy, COMPOSITEKEY);
+			// a car already in the table, the resize for the batch must not let it in twice
+			Car stored("stored", 1, MINID, true);
+			carDB.insert(stored);
+			vector<Car> cars;
+			for (int dealer = MINID; dealer < MINID + 400; dealer++)
+				cars.push_back(Car(carModels[dealer % 5], dealer % 50, dealer, true));
+			cars.push_back(cars[7]);	//duplicate inside the batch
+			cars.push_back(EMPTY);
+			cars.push_back(Car("stored", 99, MINID, true));
+			// one batch larger than the table must pre-size it instead of rehashing midway
+			if (carDB.insertBatch(cars.data(), cars.size()) != 400 || carDB.lambda() > 0.5)
+				return 0;
+			if (carDB.getCar("stored", MINID).getQuantity() != 1 || carDB.m_currentSize != 401)
+				return 0;
+			vector<Car> found(cars.size());
+			if (carDB.getCars(cars.data(), cars.size(), found.data()) != 402)
+				return 0;
+			for (int i = 0; i < 400; i++) {
+				if (!(found[i] == cars[i]))
+					return 0;
+			}
+			if (found[401].getUsed())
+				return 0;
+			vector<int> quantities(cars.size(), 3);
+			if (carDB.updateQuantities(cars.data(), quantities.data(), 400) != 400)
+				return 0;
+			for (int i = 0; i < 400; i++) {
+				if (carDB.getCar(cars[i].getModel(), cars[i].getDealer()).getQuantity() != 3)
+					return 0;
+			}
+		}
+		return 1;
+	}
+	bool testBatch_DuringMigration() {
+		CarDB carDB(MINPRIME, hashCode, QUADRATIC, COMPOSITEKEY);
+		// start a rehash with single inserts, then batch into the half migrated table
+		int dealer = MINID;
+		while (carDB.m_oldTable == NULL) {
+			carDB.insert(Car(carModels[dealer % 5], 1, dealer, true));
+			dealer++;
+		}
+		vector<Car> cars;
+		for (int i = 0; i < 10; i++, dealer++)
+			cars.push_back(Car(carModels[dealer % 5], 2, dealer, true));
+		if (carDB.insertBatch(cars.data(), cars.size()) != cars.size())
+			return 0;
+		vector<Car> keys;
+		for (int d = MINID; d < dealer; d++)
+			keys.push_back(Car(carModels[d % 5], 0, d, true));
+		vector<Car> found(keys.size());
+		carDB.getCars(keys.data(), keys.size(), found.data());
+		// the batch lookup agrees with getCar on both tables, and the batch itself is all there
+		for (size_t i = 0; i < keys.size(); i++) {
+			if (!(found[i] == carDB.getCar(keys[i].getModel(), keys[i].getDealer())))
+				return 0;
+		}
+		for (size_t i = keys.size() - cars.size(); i < keys.size(); i++) {
+			if (!(found[i] == cars[i - (keys.size() - cars.size())]))
+				return 0;
+		}
+		return 1;
+	}
+
+	bool testBatch_KeepsTheMigrationBudget() {
+		CarDB carDB(MINPRIME, hashCode, QUADRATIC, COMPOSITEKEY);
+		carDB.setMigrationBudget(8);
+		// fill a large table to just under the rehash point, with no rehash running
+		int dealer = MINID;
+		while (dealer < MINID + 2000 || carDB.m_oldTable != NULL
+			|| carDB.m_currentSize + 20 <= 0.5 * carDB.m_currentCap) {
+			carDB.insert(Car(carModels[dealer % 5], 1, dealer, true));
+			dealer++;
+		}
+		vector<Car> cars;
+		for (int i = 0; i < 20; i++, dealer++)
+			cars.push_back(Car(carModels[dealer % 5], 2, dealer, true));
+		cars.push_back(Car(carModels[MINID % 5], 9, MINID, true));	//a car the rehash moves aside
+		// the resize for the batch leaves the old table to the budget instead of draining it
+		if (carDB.insertBatch(cars.data(), cars.size()) != 20 || carDB.m_oldTable == NULL)
+			return 0;
+		if (carDB.getCar(carModels[MINID % 5], MINID).getQuantity() != 1)
+			return 0;
+		// a second batch too large for the table while the rehash runs still gets every car in
+		vector<Car> more;
+		for (int i = 0; i < 600; i++, dealer++)
+			more.push_back(Car(carModels[dealer % 5], 3, dealer, true));
+		if (carDB.insertBatch(more.data(), more.size()) != 600)
+			return 0;
+		carDB.waitForMigration();
+		for (int d = MINID; d < dealer; d++) {
+			if (!carDB.getCar(carModels[d % 5], d).getUsed())
+				return 0;
+		}
+		return carDB.m_currentSize == dealer - MINID;
+	}
+	bool testFindCar_NoAllocation() {
+		CarDB carDB(MINPRIME, hashCode, QUADRATIC, COMPOSITEKEY);
+		// a name too long for the small string buffer, so copying it would allocate
+		string model = "a model name longer than the small string buffer";
+		for (int dealer = MINID; dealer < MINID + 40; dealer++)
+			carDB.insert(Car(model, dealer % 50, dealer, true));
+		long long before = allocationCount;
+		const CarSlot* slot = carDB.findCar(model, MINID + 7);
+		const CarSlot* missing = carDB.findCar("another model that was never inserted", MINID);
+		if (allocationCount != before)
+			return 0;
+		return slot != nullptr && missing == nullptr && slot->getDealer() == MINID + 7
+			&& slot->getQuantity() == (MINID + 7) % 50 && carDB.modelName(*slot) == model;
+	}
+	bool testInsert_MoveAndEmplace() {
+		CarDB carDB(MINPRIME, hashCode, DOUBLEHASH);
+		Car car("challenger", 5, MINID, true);
+		if (!carDB.insert(std::move(car)) || carDB.getCar("challenger", MINID).getQuantity() != 5)
+			return 0;
+		// a duplicate is rejected on every path
+		if (carDB.insert(Car("challenger", 1, MINID, true)) || carDB.emplace("challenger", 1, MINID))
+			return 0;
+		if (!carDB.emplace("stratos", 3, MINID) || carDB.emplace("", 0, 0))
+			return 0;
+		return carDB.getCar("stratos", MINID).getQuantity() == 3 && carDB.m_models.size() == 3;
+	}
+
+	bool testSharded_ConcurrentWriters() {
+		ShardedCarDB carDB(8, MINPRIME, hashCode, QUADRATIC, COMPOSITEKEY);
+		const int THREADS = 4, PER_THREAD = 1000;
+		vector<int> failures(THREADS, 0);
+		// every thread inserts and updates its own dealers, then removes every tenth one
+		for (int phase = 0; phase < 2; phase++) {
+			vector<thread> threads;
+			for (int t = 0; t < THREADS; t++) {
+				threads.push_back(thread([&carDB, &failures, t, phase]() {
+					for (int i = 0; i < PER_THREAD; i++) {
+						Car car(carModels[i % 5], 1, MINID + t * PER_THREAD + i, true);
+						if (phase == 0 && (!carDB.insert(car) || !carDB.updateQuantity(car, t + 2)))
+							failures[t]++;
+						if (phase == 1 && i % 10 == 0 && !carDB.remove(car))
+							failures[t]++;
+					}
+				}));
+			}
+			for (thread& th : threads)
+				th.join();
+			for (int t = 0; t < THREADS; t++) {
+				if (failures[t] != 0)
+					return 0;
+				// the removed cars are gone; the others are only checked before the removals,
+				// since a lookup stops at a deleted bucket
+				for (int i = 0; i < PER_THREAD; i++) {
+					Car car = carDB.getCar(carModels[i % 5], MINID + t * PER_THREAD + i);
+					if (phase == 0 && car.getQuantity() != t + 2)
+						return 0;
+					if (phase == 1 && i % 10 == 0 && car.getUsed())
+						return 0;
+				}
+			}
+		}
+		// the cars spread over every shard and the aggregate load is a weighted mean
+		long long occupied = 0, capacity = 0;
+		for (int s = 0; s < carDB.shardCount(); s++) {
+			const CarDB& shard = carDB.m_shards[s]->m_db;
+			if (shard.m_currentSize == 0)
+				return 0;
+			occupied += shard.m_currentSize + shard.m_currNumDeleted;
+			capacity += shard.m_currentCap;
+		}
+		return carDB.lambda() == static_cast<float>(occupied) / capacity && carDB.deletedRatio() > 0;
+	}
+
+	bool testConcurrentReads_DuringMigration() {
+		prob_t policies[] = { QUADRATIC, GROUPPROBE, ROBINHOOD };
+		for (prob_t policy : policies) {
+			CarDB carDB(MINPRIME, hashCode, policy, COMPOSITEKEY);
+			carDB.setConcurrentReads(true);
+			const int STABLE = 200, READERS = 3;
+			for (int dealer = MINID; dealer < MINID + STABLE; dealer++)
+				carDB.insert(Car(carModels[dealer % 5], 1, dealer, true));
+			atomic<bool> done(false);
+			atomic<long long> misses(0), lookups(0);
+			vector<thread> readers;
+			// the cars inserted before the readers start must stay visible through every
+			// rehash and migration step the writer runs meanwhile
+			for (int r = 0; r < READERS; r++) {
+				readers.push_back(thread([&carDB, &done, &misses, &lookups, r]() {
+					for (int dealer = MINID + r; !done.load(); dealer = MINID + (dealer - MINID + 7) % STABLE) {
+						Car car = carDB.getCar(carModels[dealer % 5], dealer);
+						if (!car.getUsed() || car.getDealer() != dealer || car.getQuantity() < 1 || car.getQuantity() > 50)
+							misses++;
+						lookups++;
+					}
+				}));
+			}
+			for (int dealer = MINID + STABLE; dealer < MINID + 8000; dealer++) {
+				carDB.insert(Car(carModels[dealer % 5], 1, dealer, true));
+				carDB.updateQuantity(Car(carModels[dealer % 5], 0, MINID + dealer % STABLE, true), dealer % 50 + 1);
+				// GROUPPROBE lookups pass deleted slots and ROBINHOOD shifts cars back over them,
+				// so removals must not hide the stable cars
+				if (policy != QUADRATIC && dealer % 3 == 0 && dealer > MINID + STABLE)
+					carDB.remove(Car(carModels[(dealer - 1) % 5], 0, dealer - 1, true));
+			}
+			done = true;
+			for (thread& th : readers)
+				th.join();
+			if (misses != 0 || lookups == 0)
+				return 0;
+			// nothing retired is left once no reader is pinned
+			carDB.m_epochs.collect();
+			if (carDB.m_epochs.pending() != 0)
+				return 0;
+		}
+		return 1;
+	}
+
+	bool testConcurrentReads_NewModels() {
+		CarDB carDB(MINPRIME, hashCode, GROUPPROBE, COMPOSITEKEY);
+		carDB.setConcurrentReads(true);
+		const int MODELS = 3000, READERS = 3;
+		atomic<int> published(0);
+		atomic<bool> done(false);
+		atomic<long long> misses(0);
+		vector<thread> readers;
+		// every insert brings a model the readers have not seen, so its ID, name and
+		// cached hash are published while they look models up
+		for (int r = 0; r < READERS; r++) {
+			readers.push_back(thread([&carDB, &published, &done, &misses, r]() {
+				for (int k = r; !done.load(); k += 13) {
+					int known = published.load();
+					int model = (known == 0) ? 0 : k % (known + 1);
+					Car car = carDB.getCar("model " + to_string(model), MINID + model % 100);
+					if (model < known && (!car.getUsed() || car.getQuantity() != model))
+						misses++;
+				}
+			}));
+		}
+		for (int model = 0; model < MODELS; model++) {
+			carDB.insert(Car("model " + to_string(model), model, MINID + model % 100, true));
+			published.store(model + 1);
+		}
+		done = true;
+		for (thread& th : readers)
+			th.join();
+		return misses == 0 && carDB.m_models.size() == MODELS + 1;
+	}
+
+	bool testBackgroundMigration_DrainsOldTable() {
+		CarDB carDB(MINPRIME, hashCode, DOUBLEHASH, COMPOSITEKEY);
+		carDB.setBackgroundMigration(true, 64);
+		// two foreground threads share the database while the worker migrates
+		vector<thread> threads;
+		for (int t = 0; t < 2; t++) {
+			threads.push_back(thread([&carDB, t]() {
+				for (int dealer = MINID + t; dealer < MINID + 6000; dealer += 2)
+					carDB.insert(Car(carModels[dealer % 5], 1, dealer, true));
+			}));
+		}
+		for (thread& th : threads)
+			th.join();
+		for (int dealer = MINID; dealer < MINID + 6000; dealer++) {
+			if (!carDB.getCar(carModels[dealer % 5], dealer).getUsed())
+				return 0;
+		}
+		carDB.waitForMigration();
+		if (carDB.m_oldTable != nullptr || carDB.migrationProgress() != 1.0)
+			return 0;
+		if (carDB.m_currentSize - carDB.m_currNumDeleted != 6000)
+			return 0;
+		carDB.setBackgroundMigration(false);
+		// back in inline mode, inserts migrate as before
+		for (int dealer = MINID + 6000; dealer < MINID + 8000; dealer++)
+			carDB.insert(Car(carModels[dealer % 5], 1, dealer, true));
+		return carDB.getCar(carModels[MINID % 5], MINID).getUsed() && !carDB.m_worker.joinable();
+	}
+
+	bool testBackgroundMigration_InsertsHelpABoundedStep() {
+		CarDB carDB(MINPRIME, hashCode, DOUBLEHASH, COMPOSITEKEY);
+		// a worker that scans one slot per step falls behind the inserts at once
+		carDB.setBackgroundMigration(true, 1, chrono::milliseconds(50));
+		long long worst = 0, rehashes = carDB.stats().m_rehashes;
+		for (int dealer = MINID; dealer < MINID + 4000; dealer++) {
+			long long before = carDB.stats().m_migratedCars;
+			carDB.insert(Car(carModels[dealer % 5], 1, dealer, true));
+			worst = max(worst, carDB.stats().m_migratedCars - before);
+		}
+		// rehashes kept starting, and no insert moved more than a small share of a table
+		if (carDB.stats().m_rehashes < rehashes + 4 || worst > 32)
+			return 0;
+		carDB.setBackgroundMigration(true, 64);	// a faster worker for the rest
+		carDB.waitForMigration();
+		for (int dealer = MINID; dealer < MINID + 4000; dealer++) {
+			if (!carDB.getCar(carModels[dealer % 5], dealer).getUsed())
+				return 0;
+		}
+		return carDB.stats().m_size == 4000;
+	}
+
+	bool testMigrationBudget_BoundsEveryCall() {
+		const long long BUDGET = 16;
+		CarDB carDB(MINPRIME, hashCode, QUADRATIC, COMPOSITEKEY);
+		carDB.setMigrationBudget(BUDGET);
+		int next = MINID;
+		// grow through several rehashes, then remove most cars to rehash into smaller tables
+		for (int round = 0; round < 2; round++) {
+			int last = (round == 0) ? MINID + 8000 : MINID + 8000 + 500;
+			for (; next < last; next++) {
+				CarSlot* oldTable = carDB.m_oldTable;
+				long long cursor = carDB.m_oldCursor;
+				carDB.insert(Car(carModels[next % 5], 1, next, true));
+				// the same migration continues no more than BUDGET slots further,
+				// and an old table is always drained before the next rehash
+				if (oldTable != nullptr && carDB.m_oldTable == oldTable && carDB.m_oldCursor - cursor > BUDGET)
+					return 0;
+				if (oldTable != nullptr && carDB.m_oldTable != nullptr && carDB.m_oldTable != oldTable)
+					return 0;
+			}
+			if (round == 0) {
+				for (int dealer = MINID; dealer < MINID + 7000; dealer++) {
+					CarSlot* oldTable = carDB.m_oldTable;
+					long long cursor = carDB.m_oldCursor;
+					if (!carDB.remove(Car(carModels[dealer % 5], 0, dealer, true)))
+						return 0;
+					if (oldTable != nullptr && carDB.m_oldTable == oldTable && carDB.m_oldCursor - cursor > BUDGET)
+						return 0;
+					if (oldTable != nullptr && carDB.m_oldTable != nullptr && carDB.m_oldTable != oldTable)
+						return 0;
+				}
+			}
+		}
+		for (int dealer = MINID + 7000; dealer < next; dealer++) {
+			if (!carDB.getCar(carModels[dealer % 5], dealer).getUsed())
+				return 0;
+		}
+		return 1;
+	}
+
+	bool testChangeProbPolicy_SwitchesLiveTable() {
+		CarDB carDB(MINPRIME, hashCode, QUADRATIC, COMPOSITEKEY);
+		for (int dealer = MINID; dealer < MINID + 40; dealer++)
+			carDB.insert(Car(carModels[dealer % 5], dealer, dealer, true));
+		carDB.changeProbPolicy(DOUBLEHASH);
+		// the switch starts a rehash at once, into a table of the new policy
+		if (carDB.m_oldTable == nullptr || carDB.m_oldProbing != QUADRATIC || carDB.m_currProbing != DOUBLEHASH)
+			return 0;
+		// a change asked for during a rehash waits for it to finish
+		carDB.changeProbPolicy(GROUPPROBE);
+		if (carDB.m_currProbing != DOUBLEHASH || carDB.m_newPolicy != GROUPPROBE)
+			return 0;
+		for (int dealer = MINID + 40; dealer < MINID + 200; dealer++)
+			carDB.insert(Car(carModels[dealer % 5], dealer, dealer, true));
+		carDB.waitForMigration();
+		if (carDB.m_currProbing != GROUPPROBE || carDB.m_newPolicy != NONE || carDB.m_currentCtrl == nullptr)
+			return 0;
+		for (int dealer = MINID; dealer < MINID + 200; dealer++) {
+			if (carDB.getCar(carModels[dealer % 5], dealer).getQuantity() != dealer)
+				return 0;
+		}
+		// asking for the policy in use changes nothing
+		carDB.changeProbPolicy(GROUPPROBE);
+		if (carDB.m_oldTable != nullptr)
+			return 0;
+
+		// an old table of two cars drains as well, the next rehash can start after it
+		CarDB small(MINPRIME, hashCode, QUADRATIC, COMPOSITEKEY);
+		small.insert(Car(carModels[0], 1, MINID, true));
+		small.insert(Car(carModels[1], 1, MINID + 1, true));
+		small.changeProbPolicy(DOUBLEHASH);
+		for (int dealer = MINID + 2; dealer < MINID + 302; dealer++)
+			if (!small.insert(Car(carModels[dealer % 5], 1, dealer, true)))
+				return 0;
+		small.waitForMigration();
+		if (small.m_currProbing != DOUBLEHASH || small.m_currentSize != 302)
+			return 0;
+		return small.getCar(carModels[0], MINID).getUsed() && small.getCar(carModels[1], MINID + 1).getUsed();
+	}
+
+	bool testAdaptivePolicy_ReportsEqualHashes() {
+		// model keys: every dealer of a model has the same hash and probe sequence, which
+		// no policy spreads, so the policy stays and stats points at the key mode
+		CarDB carDB(MINPRIME, hashCode, QUADRATIC);
+		carDB.setAdaptivePolicy(true, 4.0, 64);
+		for (int dealer = MINID; dealer < MINID + 3000; dealer++)
+			carDB.insert(Car(carModels[dealer % 5], dealer, dealer, true));
+		carDB.waitForMigration();
+		if (carDB.m_currProbing != QUADRATIC || !carDB.stats().m_equalHashes)
+			return 0;
+		if (carDB.stats().toJson().find("\"equal_hashes\":true") == string::npos)
+			return 0;
+		for (int dealer = MINID; dealer < MINID + 3000; dealer++) {
+			if (carDB.getCar(carModels[dealer % 5], dealer).getQuantity() != dealer)
+				return 0;
+		}
+		// well spread keys keep the policy they start with
+		CarDB spread(MINPRIME, hashCode, QUADRATIC, COMPOSITEKEY);
+		spread.setAdaptivePolicy(true, 4.0, 64);
+		for (int dealer = MINID; dealer < MINID + 3000; dealer++)
+			spread.insert(Car(carModels[dealer % 5], dealer, dealer, true));
+		return spread.m_currProbing == QUADRATIC && !spread.stats().m_equalHashes;
+	}
+	bool testAdaptivePolicy_UndoesAChangeThatDidNotHelp() {
+		// every window counts as degraded, a change is judged on the window after its rehash
+		for (double baseline : { 0.0, 1e9 }) {
+			CarDB carDB(MINPRIME, hashCode, DOUBLEHASH, COMPOSITEKEY);
+			for (int dealer = MINID; dealer < MINID + 1000; dealer++)
+				carDB.insert(Car(carModels[dealer % 5], 1, dealer, true));
+			carDB.waitForMigration();
+			carDB.setAdaptivePolicy(true, -1.0, -1);
+			carDB.m_adaptFrom = QUADRATIC;
+			carDB.m_adaptBaseline = baseline;
+			for (int round = 0; round < 8; round++) {
+				for (int dealer = MINID; dealer < MINID + 1000; dealer++)
+					carDB.updateQuantity(Car(carModels[dealer % 5], 0, dealer, true), round);
+				carDB.waitForMigration();
+			}
+			// no average is below 0, so the change is undone and not tried again; any is below 1e9
+			if (carDB.m_currProbing != ((baseline == 0.0) ? QUADRATIC : GROUPPROBE))
+				return 0;
+			for (int dealer = MINID; dealer < MINID + 1000; dealer++) {
+				if (carDB.getCar(carModels[dealer % 5], dealer).getQuantity() != 7)
+					return 0;
+			}
+		}
+		return 1;
+	}
+
+	bool testStats_CountsOperationsAndMigration() {
+		CarDB carDB(MINPRIME, hashCode, QUADRATIC, COMPOSITEKEY);
+		for (int dealer = MINID; dealer < MINID + 300; dealer++)
+			carDB.insert(Car(carModels[dealer % 5], 1, dealer, true));
+		carDB.insert(Car(carModels[MINID % 5], 1, MINID, true));	// duplicate, still a call
+		for (int dealer = MINID; dealer < MINID + 100; dealer++) {
+			carDB.getCar(carModels[dealer % 5], dealer);
+			carDB.updateQuantity(Car(carModels[dealer % 5], 0, dealer, true), 2);
+		}
+		for (int dealer = MINID; dealer < MINID + 50; dealer++)
+			carDB.remove(Car(carModels[dealer % 5], 0, dealer, true));
+		CarDBStats stats = carDB.stats();
+		if (stats.m_ops[STAT_INSERT] != 301 || stats.m_ops[STAT_FIND] != 100 || stats.m_ops[STAT_UPDATE] != 100 || stats.m_ops[STAT_REMOVE] != 50)
+			return 0;
+		// every call lands in one histogram bucket
+		for (int op = 0; op < NUM_STAT_OPS; op++) {
+			long long calls = 0;
+			for (int bucket = 0; bucket < PROBE_BUCKETS; bucket++)
+				calls += stats.m_probeHist[op][bucket];
+			if (calls != stats.m_ops[op])
+				return 0;
+		}
+		if (stats.m_rehashes == 0 || stats.m_migratedCars == 0 || stats.m_oldHits > stats.m_oldLookups)
+			return 0;
+		if (stats.m_size != 250 || stats.m_capacity != carDB.m_currentCap || stats.m_policy != QUADRATIC)
+			return 0;
+		string prometheus = stats.toPrometheus();
+		string json = stats.toJson();
+		return prometheus.find("cardb_ops_total{op=\"insert\"} 301\n") != string::npos
+			&& prometheus.find("cardb_probe_length_bucket{op=\"remove\",le=\"+Inf\"} 50\n") != string::npos
+			&& json.find("\"find\":{\"count\":100,") != string::npos
+			&& json.find("\"size\":250,") != string::npos;
+	}
+
+	bool testStats_GroupProbesCountSlots() {
+		// one model under model keys: its cars fill the slots after the home slot in order
+		CarDB carDB(MINPRIME, hashCode, GROUPPROBE);
+		for (int dealer = MINID; dealer < MINID + 200; dealer++)
+			carDB.insert(Car(carModels[0], 1, dealer, true));
+		carDB.waitForMigration();
+		for (int dealer = MINID; dealer < MINID + 200; dealer++)
+			carDB.getCar(carModels[0], dealer);
+		// a lookup passes a group per 16 cars ahead of it, each counted as the slots it covers
+		long long probes = carDB.stats().m_probes[STAT_FIND];
+		return probes % 16 == 0 && probes >= 200 * 200 / 4;
+	}
+
+	bool testSnapshot_RoundTrip() {
+		const char* path = "mytest_snapshot.bin";
+		prob_t policies[] = { QUADRATIC, GROUPPROBE, ROBINHOOD };
+		for (prob_t policy : policies) {
+			CarDB carDB(MINPRIME, hashCode, policy, COMPOSITEKEY);
+			for (int dealer = MINID; dealer < MINID + 2000; dealer++)
+				carDB.insert(Car(carModels[dealer % 5], dealer % 50, dealer, true));
+			for (int dealer = MINID; dealer < MINID + 2000; dealer += 7)
+				carDB.remove(Car(carModels[dealer % 5], 0, dealer, true));
+			// a migration in progress is finished before the table is written
+			if (!carDB.saveSnapshot(path) || carDB.m_oldTable != nullptr)
+				return 0;
+			unique_ptr<CarDB> opened = CarDB::openSnapshot(path, hashCode);
+			if (opened == nullptr || opened->m_currentTable != opened->m_mappedTable || opened->m_currProbing != policy)
+				return 0;
+			if (opened->m_currentCap != carDB.m_currentCap || opened->m_models.size() != carDB.m_models.size())
+				return 0;
+			for (int dealer = MINID; dealer < MINID + 2000; dealer++) {
+				if (!(opened->getCar(carModels[dealer % 5], dealer) == carDB.getCar(carModels[dealer % 5], dealer)))
+					return 0;
+			}
+			// the opened database takes writes and rehashes away from the mapped table
+			for (int dealer = MINID + 2000; dealer < MINID + 6000; dealer++)
+				opened->insert(Car(carModels[dealer % 5], 1, dealer, true));
+			opened->waitForMigration();
+			if (opened->m_mappedTable != nullptr || !opened->getCar(carModels[1], MINID + 1).getUsed())
+				return 0;
+		}
+		// another hash function, another key hash kind or no file are all refused
+		CarDB carDB(MINPRIME, hashCode, DOUBLEHASH);
+		carDB.insert(Car(carModels[0], 1, MINID, true));
+		carDB.saveSnapshot(path);
+		unsigned int (*otherHash)(string) = [](string model) { return hashCode(model) + 1; };
+		bool refused = CarDB::openSnapshot(path, otherHash) == nullptr && CarDB::openSnapshot(path, keyHashCode) == nullptr;
+		std::remove(path);
+		return refused && CarDB::openSnapshot(path, hashCode) == nullptr;
+	}
+
+	bool testJournal_RecoversOnTopOfSnapshot() {
+		const char* snapshot = "mytest_snapshot.bin";
+		const char* journal = "mytest_journal.bin";
+		std::remove(journal);
+		long long groups = 0;
+		CarDB carDB(MINPRIME, hashCode, GROUPPROBE, COMPOSITEKEY);
+		if (!carDB.openJournal(journal, chrono::milliseconds(50)))
+			return 0;
+		for (int dealer = MINID; dealer < MINID + 500; dealer++)
+			carDB.insert(Car(carModels[dealer % 5], 1, dealer, true));
+		// the snapshot takes over everything journalled so far
+		if (!carDB.saveSnapshot(snapshot))
+			return 0;
+		for (int dealer = MINID + 500; dealer < MINID + 800; dealer++)
+			carDB.insert(Car(carModels[dealer % 5], 2, dealer, true));
+		for (int dealer = MINID; dealer < MINID + 800; dealer += 9)
+			carDB.remove(Car(carModels[dealer % 5], 0, dealer, true));
+		for (int dealer = MINID + 1; dealer < MINID + 800; dealer += 9)
+			carDB.updateQuantity(Car(carModels[dealer % 5], 0, dealer, true), 40);
+		carDB.insert(Car("enzo", 3, MINID, true));	// a model the snapshot does not know
+		carDB.syncJournal();
+		// many operations went to disk in a few groups, each with one sync
+		groups = carDB.m_journal->groups();
+		if (groups > 10)
+			return 0;
+
+		// a crash in the middle of a group leaves a torn tail, which is ignored
+		{
+			ofstream torn(journal, ios::binary | ios::app);
+			torn.write("\x20\x00\x00\x00garbage", 11);
+		}
+		unique_ptr<CarDB> recovered = CarDB::openSnapshot(snapshot, hashCode);
+		if (recovered == nullptr || recovered->replayJournal(journal) != 300 + 89 + 89 + 1)
+			return 0;
+		for (int dealer = MINID; dealer < MINID + 800; dealer++) {
+			Car expected = carDB.getCar(carModels[dealer % 5], dealer);
+			Car actual = recovered->getCar(carModels[dealer % 5], dealer);
+			if (!(actual == expected) || actual.getQuantity() != expected.getQuantity() || actual.getUsed() != expected.getUsed())
+				return 0;
+		}
+		if (recovered->getCar("enzo", MINID).getQuantity() != 3)
+			return 0;
+		// journalling carries on in the same file after the torn tail is cut off
+		if (!recovered->openJournal(journal, chrono::microseconds(0)))
+			return 0;
+		recovered->remove(Car("enzo", 0, MINID, true));
+		recovered->closeJournal();
+		unique_ptr<CarDB> again = CarDB::openSnapshot(snapshot, hashCode);
+		bool replayed = again != nullptr && again->replayJournal(journal) == 300 + 89 + 89 + 1 + 1
+			&& !again->getCar("enzo", MINID).getUsed() && again->getCar(carModels[(MINID + 1) % 5], MINID + 1).getQuantity() == 40;
+		std::remove(snapshot);
+		std::remove(journal);
+		return replayed;
+	}
+
+	bool testLoadCsv_ParallelMatchesSequential() {
+		const char* path = "mytest_inventory.csv";
+		{
+			ofstream csv(path, ios::binary | ios::trunc);
+			csv << "model,dealer,quantity\r\n";
+			for (int dealer = MINID; dealer < MINID + 2000; dealer++) {
+				csv << carModels[dealer % 5] << ", " << dealer << "," << dealer % 50 << ((dealer % 3 == 0) ? "\r\n" : "\n");
+				if (dealer % 400 == 0)
+					csv << "\n";
+			}
+			csv << "\"model x\",1234,7\n";
+			// a quoted line break does not end the row, in whichever chunk it falls
+			for (int k = 0; k < 20; k++)
+				csv << "\"line\nbreak\r\n" << k << "\"," << 1000 + k << ",5\n";
+			// a repeated car keeps the quantity of its first row
+			for (int dealer = MINID; dealer < MINID + 100; dealer++)
+				csv << carModels[dealer % 5] << "," << dealer << ",999\n";
+			csv << "bad row\nx,abc,3\na,1,2,3\n,0,0";
+		}
+		CsvLoadReport parallel, sequential;
+		CarDB carDB(MINPRIME, hashCode, GROUPPROBE, COMPOSITEKEY);
+		CarDB expected(MINPRIME, hashCode, GROUPPROBE, COMPOSITEKEY);
+		bool loaded = carDB.loadCsv(path, parallel, 4, 97) && expected.loadCsv(path, sequential, 1);
+		std::remove(path);
+		if (!loaded || parallel.m_rows != 2125 || parallel.m_inserted != 2021 || parallel.m_duplicates != 100 || parallel.m_rejected != 4)
+			return 0;
+		if (sequential.m_rows != parallel.m_rows || sequential.m_inserted != parallel.m_inserted)
+			return 0;
+		// sized once for the whole file, nothing is left to migrate
+		if (carDB.m_oldTable != nullptr || carDB.m_currentSize != 2021 || carDB.lambda() > 0.5)
+			return 0;
+		for (int k = 0; k < 20; k++)
+			if (carDB.getCar("line\nbreak\r\n" + to_string(k), 1000 + k).getQuantity() != 5)
+				return 0;
+		for (int dealer = MINID; dealer < MINID + 2000; dealer++) {
+			Car car = carDB.getCar(carModels[dealer % 5], dealer);
+			if (!car.getUsed() || car.getQuantity() != dealer % 50 || !(expected.getCar(carModels[dealer % 5], dealer) == car))
+				return 0;
+		}
+		// a bad first line is a rejected row, not a header
+		{
+			ofstream csv(path, ios::binary | ios::trunc);
+			csv << "model;dealer;quantity\n" << carModels[0] << "," << MINID << ",1\n";
+		}
+		CsvLoadReport headless;
+		CarDB other(MINPRIME, hashCode, GROUPPROBE, COMPOSITEKEY);
+		loaded = other.loadCsv(path, headless, 2);
+		std::remove(path);
+		if (!loaded || headless.m_rows != 2 || headless.m_rejected != 1 || headless.m_inserted != 1)
+			return 0;
+		CsvLoadReport missing;
+		return carDB.getCar("model x", 1234).getQuantity() == 7 && !carDB.loadCsv("mytest_missing.csv", missing);
+	}
+
+	bool testReserve_SkipsRehashAndShrinkReleases() {
+		CarDB carDB(MINPRIME, hashCode, GROUPPROBE, COMPOSITEKEY);
+		carDB.reserve(5000);
+		long long rehashes = carDB.m_rehashes;
+		for (int dealer = MINID; dealer < MINID + 5000; dealer++)
+			carDB.insert(Car(carModels[dealer % 5], 1, dealer, true));
+		// one rehash made room for all of them
+		if (rehashes != 1 || carDB.m_rehashes != rehashes || carDB.m_currentCap <= 10000)
+			return 0;
+		for (int dealer = MINID + 100; dealer < MINID + 5000; dealer++)
+			carDB.remove(Car(carModels[dealer % 5], 0, dealer, true));
+		// the tombstones go, the reserved capacity stays until shrink_to_fit
+		if (carDB.m_currentCap <= 10000)
+			return 0;
+		carDB.shrink_to_fit();
+		carDB.waitForMigration();
+		if (carDB.m_currentCap != CarDB::findNextPrime(100 * 4) || carDB.m_oldTable != nullptr)
+			return 0;
+		for (int dealer = MINID; dealer < MINID + 100; dealer++)
+			if (!carDB.getCar(carModels[dealer % 5], dealer).getUsed())
+				return 0;
+
+		// while a rehash runs the new size waits for it, then takes over
+		int dealer = MINID + 100;
+		for (; carDB.m_oldTable == nullptr; dealer++)
+			carDB.insert(Car(carModels[dealer % 5], 1, dealer, true));
+		carDB.reserve(20000);
+		if (!carDB.m_resizePending || carDB.m_currentCap > 40000)
+			return 0;
+		carDB.waitForMigration();
+		carDB.insert(Car(carModels[dealer % 5], 1, dealer, true));
+		dealer++;
+		carDB.waitForMigration();
+		if (carDB.m_resizePending || carDB.m_currentCap <= 40000)
+			return 0;
+		for (int d = MINID; d < dealer; d++)
+			if (!carDB.getCar(carModels[d % 5], d).getUsed())
+				return 0;
+
+		// a table of two cars grows and shrinks back without leaving an old table behind
+		CarDB small(MINPRIME, hashCode, QUADRATIC, COMPOSITEKEY);
+		small.insert(Car(carModels[0], 1, MINID, true));
+		small.insert(Car(carModels[1], 1, MINID + 1, true));
+		small.reserve(5000);
+		small.waitForMigration();
+		if (small.m_oldTable != nullptr || small.m_currentCap <= 10000)
+			return 0;
+		small.shrink_to_fit();
+		small.waitForMigration();
+		if (small.m_oldTable != nullptr || small.m_currentCap >= 10000)
+			return 0;
+		return small.getCar(carModels[0], MINID).getUsed() && small.getCar(carModels[1], MINID + 1).getUsed();
+	}
+
+	bool testDealerIndex_MatchesScan() {
+		for (prob_t policy : { QUADRATIC, GROUPPROBE, ROBINHOOD }) {
+			CarDB carDB(MINPRIME, hashCode, policy, COMPOSITEKEY);
+			for (int k = 0; k < 300; k++)
+				carDB.insert(Car(carModels[k % 5] + to_string(k / 50), k, MINID + k % 40, true));
+			// built from the tables, then kept up by every insert, remove and migration
+			carDB.setDealerIndex(true);
+			for (int k = 300; k < 3000; k++)
+				carDB.insert(Car(carModels[k % 5] + to_string(k / 50), k, MINID + k % 40, true));
+			for (int k = 0; k < 3000; k += 3)
+				carDB.remove(Car(carModels[k % 5] + to_string(k / 50), 0, MINID + k % 40, true));
+			carDB.insert(Car("outlier", 1, 42, true));	// outside MINID..MAXID
+			for (int dealer : { MINID, MINID + 7, MINID + 39, MINID + 40, 42 }) {
+				vector<Car> indexed = carDB.getCarsAt(dealer);
+				vector<vector<uint32_t>> index = std::move(carDB.m_dealerIndex);
+				carDB.m_dealerIndex.clear();
+				vector<Car> scanned = carDB.getCarsAt(dealer);
+				carDB.m_dealerIndex = std::move(index);
+				// the scan also sees the cars a QUADRATIC probe can no longer reach, getCar does not
+				long long reachable = 0;
+				for (const Car& car : scanned)
+					reachable += (carDB.getCar(car.getModel(), dealer) == car) ? 1 : 0;
+				if (static_cast<long long>(indexed.size()) != reachable || (dealer != MINID + 40 && reachable == 0))
+					return 0;
+				for (const Car& car : indexed)
+					if (!car.getUsed() || car.getDealer() != dealer || !(carDB.getCar(car.getModel(), dealer) == car))
+						return 0;
+			}
+		}
+		return 1;
+	}
+
+	bool testModelTotals_FollowEveryChange() {
+		for (prob_t policy : { GROUPPROBE, ROBINHOOD }) {
+			CarDB carDB(MINPRIME, hashCode, policy, COMPOSITEKEY);
+			carDB.setMigrationBudget(16);	// keeps an old table around for most calls
+			map<pair<int, int>, int> stock;	// (model, dealer) to quantity, as getCar sees it
+			mt19937 generator(7);
+			for (int step = 0; step < 20000; step++) {
+				int model = generator() % 5, dealer = MINID + generator() % 600, quantity = generator() % 100;
+				Car car(carModels[model], quantity, dealer, true);
+				int op = generator() % 4;
+				if (op < 2)
+					carDB.insert(car);
+				else if (op == 2)
+					carDB.remove(car);
+				else
+					carDB.updateQuantity(car, quantity);
+				// a car removed from the current table may still have a copy in the old one
+				Car stored = carDB.getCar(carModels[model], dealer);
+				if (stored.getUsed())
+					stock[{ model, dealer }] = stored.getQuantity();
+				else
+					stock.erase({ model, dealer });
+			}
+			for (int model = 0; model < 5; model++) {
+				ModelTotals expected = { 0, 0 };
+				for (const auto& entry : stock) {
+					if (entry.first.first == model) {
+						expected.m_quantity += entry.second;
+						expected.m_dealers++;
+					}
+				}
+				ModelTotals totals = carDB.modelTotals(carModels[model]);
+				if (totals.m_quantity != expected.m_quantity || totals.m_dealers != expected.m_dealers)
+					return 0;
+			}
+			// a snapshot carries them, opening it does not read the slots
+			const char* path = "mytest_snapshot.bin";
+			bool saved = carDB.saveSnapshot(path);
+			unique_ptr<CarDB> reopened = saved ? CarDB::openSnapshot(path, hashCode) : nullptr;
+			std::remove(path);
+			if (reopened == nullptr)
+				return 0;
+			for (int model = 0; model < 5; model++) {
+				ModelTotals totals = carDB.modelTotals(carModels[model]), again = reopened->modelTotals(carModels[model]);
+				if (totals.m_quantity != again.m_quantity || totals.m_dealers != again.m_dealers)
+					return 0;
+			}
+			ModelTotals none = carDB.modelTotals("unknown");
+			if (none.m_quantity != 0 || none.m_dealers != 0)
+				return 0;
+		}
+		return 1;
+	}
+
+	bool testIterator_VisitsEveryLiveCarOnce() {
+		for (prob_t policy : { QUADRATIC, GROUPPROBE, ROBINHOOD }) {
+			CarDB carDB(MINPRIME, hashCode, policy, COMPOSITEKEY);
+			carDB.setMigrationBudget(16);	// the walk meets an old table half migrated
+			map<pair<uint32_t, int>, int> expected;
+			auto modelOf = [this](int dealer) {
+				if (dealer % 89 == 0)
+					return string((dealer % 2 == 0) ? "19\" wheels" : "\"dune\", buggy");
+				if (dealer % 83 == 0)
+					return string((dealer % 2 == 0) ? "line\nbreak" : "carriage\rreturn\n");
+				return (dealer % 97 == 0) ? string("fiat, 500") : carModels[dealer % 5];
+			};
+			int last = MINID;
+			for (; last < MINID + 3000 || carDB.m_oldTable == nullptr; last++) {
+				carDB.insert(Car(modelOf(last), last % 70, last, true));
+				if (last % 7 == 0)
+					carDB.remove(Car(modelOf(last - 3), 0, last - 3, true));
+			}
+			for (int dealer = MINID; dealer < last; dealer++) {
+				string model = modelOf(dealer);
+				const CarSlot* slot = carDB.findCar(model, dealer);
+				if (slot != nullptr)
+					expected[{ slot->getModelId(), dealer }] = slot->getQuantity();
+			}
+			size_t visited = 0;
+			for (const CarSlot& slot : carDB) {
+				auto found = expected.find({ slot.getModelId(), slot.getDealer() });
+				if (!slot.getUsed() || found == expected.end() || found->second != slot.getQuantity())
+					return 0;
+				visited++;
+			}
+			if (visited != expected.size())
+				return 0;
+			// the export reads back into the same cars, the models with a comma, a quote or a
+			// line break quoted
+			const char* path = "mytest_export.csv";
+			size_t written = 0;
+			{
+				ofstream out(path, ios::binary | ios::trunc);
+				written = carDB.exportCsv(out);
+			}
+			CarDB loaded(MINPRIME, hashCode, GROUPPROBE, COMPOSITEKEY);
+			CsvLoadReport report;
+			bool read = loaded.loadCsv(path, report, 2);
+			std::remove(path);
+			if (!read || written != visited || report.m_inserted != static_cast<long long>(written) || report.m_rejected != 0)
+				return 0;
+			for (const CarSlot& slot : carDB) {
+				Car copy = loaded.getCar(carDB.modelName(slot), slot.getDealer());
+				if (!copy.getUsed() || copy.getQuantity() != slot.getQuantity())
+					return 0;
+			}
+		}
+		CarDB empty(MINPRIME, hashCode, QUADRATIC);
+		return empty.begin() == empty.end();
+	}
+
+	bool testQuantityDeltas_InPlaceInBothTables() {
+		CarDB carDB(MINPRIME, hashCode, GROUPPROBE, COMPOSITEKEY);
+		carDB.setMigrationBudget(16);	// keeps cars in both tables
+		int dealer = MINID;
+		while (carDB.m_oldTable == nullptr || carDB.m_oldSize - carDB.m_oldNumDeleted < 20) {
+			Car car(carModels[dealer % 5], 10, dealer, true);
+			if (!carDB.insert(car))
+				return 0;
+			dealer++;
+		}
+		long long before = carDB.modelTotals(carModels[0]).m_quantity;
+		int checked[2] = { 0, 0 };	// cars met in the current and the old table
+		for (int id = MINID; id < dealer; id += 5) {
+			const CarSlot* slot = carDB.locate(carDB.m_models.find(carModels[0]), id, carDB.hashKey(carDB.m_models.find(carModels[0]), id));
+			if (slot == nullptr)
+				return 0;
+			bool old = slot >= carDB.m_oldTable && slot < carDB.m_oldTable + carDB.m_oldCap;
+			checked[old]++;
+			int quantity = -1;
+			// a sale, a sale of more cars than are left, a delivery and one past INT_MAX
+			if (carDB.addQuantity(carModels[0], id, -3, quantity) != QTY_DONE || quantity != 7)
+				return 0;
+			if (carDB.addQuantity(carModels[0], id, -8, quantity) != QTY_UNDERFLOW || quantity != 7)
+				return 0;
+			if (carDB.addQuantity(carModels[0], id, INT_MAX - 7, quantity) != QTY_DONE || quantity != INT_MAX)
+				return 0;
+			if (carDB.addQuantity(carModels[0], id, 1, quantity) != QTY_OVERFLOW || quantity != INT_MAX)
+				return 0;
+			// a stale expected value is refused and corrected
+			int expected = 7;
+			if (carDB.compareAndSetQuantity(carModels[0], id, expected, 4) != QTY_CONFLICT || expected != INT_MAX)
+				return 0;
+			if (carDB.compareAndSetQuantity(carModels[0], id, expected, -1) != QTY_UNDERFLOW)
+				return 0;
+			if (carDB.compareAndSetQuantity(carModels[0], id, expected, 4) != QTY_DONE)
+				return 0;
+			// the slot changed where it was, nothing moved or was copied
+			if (slot->getQuantity() != 4 || carDB.getCar(carModels[0], id).getQuantity() != 4)
+				return 0;
+			before -= 6;
+		}
+		if (checked[0] == 0 || checked[1] == 0)
+			return 0;
+		if (carDB.modelTotals(carModels[0]).m_quantity != before)
+			return 0;
+		int quantity = 5;
+		if (carDB.addQuantity(carModels[0], MAXID + 1, 1, quantity) != QTY_MISSING || quantity != 5
+			|| carDB.addQuantity("unknown", MINID, 1, quantity) != QTY_MISSING)
+			return 0;
+		return 1;
+	}
+
+	bool testQuantityDeltas_ConcurrentSalesAddUp() {
+		ShardedCarDB carDB(8, MINPRIME, hashCode, GROUPPROBE, COMPOSITEKEY);
+		const int THREADS = 4, CARS = 64, ROUNDS = 2000, STOCK = 1000;
+		for (int i = 0; i < CARS; i++) {
+			Car car(carModels[i % 5], STOCK, MINID + i, true);
+			if (!carDB.insert(car))
+				return 0;
+		}
+		// every thread delivers two cars and sells three, the last threads sell with CAS
+		vector<long long> sold(THREADS, 0);
+		vector<thread> threads;
+		for (int t = 0; t < THREADS; t++) {
+			threads.push_back(thread([&carDB, &sold, t, this]() {
+				for (int r = 0; r < ROUNDS; r++) {
+					int i = (r * 7 + t) % CARS, quantity = 0;
+					string_view model = carModels[i % 5];
+					carDB.addQuantity(model, MINID + i, 2, quantity);
+					if (t < 2) {
+						if (carDB.addQuantity(model, MINID + i, -3, quantity) == QTY_DONE)
+							sold[t] += 3;
+						continue;
+					}
+					int expected = carDB.getCar(carModels[i % 5], MINID + i).getQuantity();
+					while (expected >= 3) {
+						if (carDB.compareAndSetQuantity(model, MINID + i, expected, expected - 3) == QTY_DONE) {
+							sold[t] += 3;
+							break;
+						}
+					}
+				}
+			}));
+		}
+		for (thread& th : threads)
+			th.join();
+		long long total = 0, expected = static_cast<long long>(CARS) * STOCK + 2LL * THREADS * ROUNDS;
+		for (long long count : sold)
+			expected -= count;
+		for (int i = 0; i < CARS; i++)
+			total += carDB.getCar(carModels[i % 5], MINID + i).getQuantity();
+		return total == expected;
+	}
+
+	bool testQuantityDeltas_LockFreeOnOneTable() {
+		CarDB carDB(MINPRIME, hashCode, GROUPPROBE, COMPOSITEKEY);
+		carDB.setConcurrentReads(true);
+		const int THREADS = 4, CARS = 64, ROUNDS = 2000, STOCK = 1000;
+		for (int i = 0; i < CARS; i++)
+			carDB.insert(Car(carModels[i % 5], STOCK, MINID + i, true));
+		long long before = 0;
+		for (int model = 0; model < 5; model++)
+			before += carDB.modelTotals(carModels[model]).m_quantity;
+		// no lock at all: the deltas race each other and a reader on the same cars
+		vector<long long> sold(THREADS, 0);
+		atomic<bool> done(false);
+		atomic<long long> torn(0);
+		thread reader([&carDB, &done, &torn, this]() {
+			for (int i = 0; !done.load(); i = (i + 1) % CARS) {
+				Car car = carDB.getCar(carModels[i % 5], MINID + i);
+				if (!car.getUsed() || car.getQuantity() < 0)
+					torn++;
+				carDB.modelTotals(carModels[i % 5]);
+			}
+		});
+		vector<thread> threads;
+		for (int t = 0; t < THREADS; t++) {
+			threads.push_back(thread([&carDB, &sold, t, this]() {
+				for (int r = 0; r < ROUNDS; r++) {
+					int i = (r * 7 + t) % CARS, quantity = 0;
+					string_view model = carModels[i % 5];
+					carDB.addQuantity(model, MINID + i, 2, quantity);
+					if (t % 2 == 0) {
+						if (carDB.addQuantity(model, MINID + i, -3, quantity) == QTY_DONE)
+							sold[t] += 3;
+						continue;
+					}
+					int expected = carDB.getCar(model, MINID + i).getQuantity();
+					while (expected >= 3 && carDB.compareAndSetQuantity(model, MINID + i, expected, expected - 3) != QTY_DONE);
+					if (expected >= 3)
+						sold[t] += 3;
+				}
+			}));
+		}
+		for (thread& th : threads)
+			th.join();
+		done = true;
+		reader.join();
+		long long expected = before + 2LL * THREADS * ROUNDS, total = 0, totals = 0;
+		for (long long count : sold)
+			expected -= count;
+		for (int i = 0; i < CARS; i++)
+			total += carDB.getCar(carModels[i % 5], MINID + i).getQuantity();
+		for (int model = 0; model < 5; model++)
+			totals += carDB.modelTotals(carModels[model]).m_quantity;
+		return torn == 0 && total == expected && totals == expected;
+	}
+
+	bool testParallelScan_MatchesIterator() {
+		for (prob_t policy : { QUADRATIC, GROUPPROBE, ROBINHOOD }) {
+			CarDB carDB(MINPRIME, hashCode, policy, COMPOSITEKEY);
+			carDB.setMigrationBudget(16);	// chunks of both tables, the old one half migrated
+			int dealer = MINID;
+			for (; dealer < MINID + 20000 || carDB.m_oldTable == nullptr; dealer++) {
+				carDB.insert(Car(carModels[dealer % 5], dealer % 30, dealer, true));
+				if (dealer % 5 == 0)
+					carDB.updateQuantity(Car(carModels[(dealer - 7) % 5], 0, dealer - 7, true), 99);
+			}
+			long long cars = 0, quantity = 0;
+			for (const CarSlot& slot : carDB) {
+				cars++;
+				quantity += slot.getQuantity();
+			}
+			for (int threads : { 1, 4 }) {
+				atomic<long long> visited(0);
+				carDB.parallelForEach([&visited](const CarSlot&) { visited.fetch_add(1, memory_order_relaxed); }, threads);
+				// quantity by model, merged from the partials of the threads
+				vector<long long> byModel = carDB.parallelReduce(vector<long long>(carDB.m_models.size(), 0),
+					[](vector<long long>& partial, const CarSlot& slot) { partial[slot.getModelId()] += slot.getQuantity(); },
+					[](vector<long long>& result, const vector<long long>& partial) {
+						for (size_t id = 0; id < partial.size(); id++)
+							result[id] += partial[id];
+					}, threads);
+				long long total = 0;
+				for (int model = 0; model < 5; model++) {
+					long long sum = byModel[carDB.m_models.find(carModels[model])];
+					if (sum != carDB.modelTotals(carModels[model]).m_quantity)
+						return 0;
+					total += sum;
+				}
+				if (visited.load() != cars || total != quantity)
+					return 0;
+			}
+		}
+		return 1;
+	}
+
 	void runAllTests() {
 		cout << "Test Insertion Normal : " << (testInsertion() ? "Passed" : "Failed") << endl;
 		cout << "Test Insertion Empty Car : " << (testInsertionEmpty() ? "Passed" : "Failed") << endl;
@@ -534,6 +1758,43 @@ public:
 		cout << "Test Find Colliding Keys : " << (testFind_CollidingKeys() ? "Passed" : "Failed") << endl;
 		cout << "\nTest Rehash Data Insertion : " << (testRehashDataInsertion_and_LoadFactor() ? "Passed" : "Failed") << endl;
 		cout << "Test Rehash Data Removal : " << (testRehashDataRemoval_and_DeletionRatio() ? "Passed" : "Failed") << endl;
+		cout << "\nTest Composite Key Same Model Many Dealers : " << (testCompositeKey_SameModelManyDealers() ? "Passed" : "Failed") << endl;
+		cout << "Test Composite Key Hash Function : " << (testCompositeKey_KeyHashFunction() ? "Passed" : "Failed") << endl;
+		cout << "\nTest FastMod Matches Modulo : " << (testFastMod_MatchesModulo() ? "Passed" : "Failed") << endl;
+		cout << "Test Rehash Grows Past MAXPRIME : " << (testRehash_GrowsPastMAXPRIME() ? "Passed" : "Failed") << endl;
+		cout << "Test Cached Hash Survives Rehash : " << (testCachedHash_SurvivesRehash() ? "Passed" : "Failed") << endl;
+		cout << "\nTest GROUPPROBE Insert Find Remove : " << (testGroupProbe_InsertFindRemove() ? "Passed" : "Failed") << endl;
+		cout << "Test GROUPPROBE Colliding Keys : " << (testGroupProbe_CollidingKeys() ? "Passed" : "Failed") << endl;
+		cout << "Test ROBINHOOD Churn Leaves No Tombstones : " << (testRobinHood_ChurnLeavesNoTombstones() ? "Passed" : "Failed") << endl;
+		cout << "Test ROBINHOOD Colliding Keys : " << (testRobinHood_CollidingKeys() ? "Passed" : "Failed") << endl;
+		cout << "Test Reserve Skips Rehash And Shrink Releases : " << (testReserve_SkipsRehashAndShrinkReleases() ? "Passed" : "Failed") << endl;
+		cout << "\nTest Dealer Index Matches Scan : " << (testDealerIndex_MatchesScan() ? "Passed" : "Failed") << endl;
+		cout << "Test Model Totals Follow Every Change : " << (testModelTotals_FollowEveryChange() ? "Passed" : "Failed") << endl;
+		cout << "Test Iterator Visits Every Live Car Once : " << (testIterator_VisitsEveryLiveCarOnce() ? "Passed" : "Failed") << endl;
+		cout << "Test Parallel Scan Matches Iterator : " << (testParallelScan_MatchesIterator() ? "Passed" : "Failed") << endl;
+		cout << "Test Quantity Deltas In Place In Both Tables : " << (testQuantityDeltas_InPlaceInBothTables() ? "Passed" : "Failed") << endl;
+		cout << "Test Quantity Deltas Concurrent Sales Add Up : " << (testQuantityDeltas_ConcurrentSalesAddUp() ? "Passed" : "Failed") << endl;
+		cout << "Test Quantity Deltas Lock Free On One Table : " << (testQuantityDeltas_LockFreeOnOneTable() ? "Passed" : "Failed") << endl;
+		cout << "\nTest Model Dictionary Interns Every Model Once : " << (testModelDict_InternsEveryModelOnce() ? "Passed" : "Failed") << endl;
+		cout << "\nTest Batch Matches Single Calls : " << (testBatch_MatchesSingleCalls() ? "Passed" : "Failed") << endl;
+		cout << "Test Batch During Migration : " << (testBatch_DuringMigration() ? "Passed" : "Failed") << endl;
+		cout << "Test Batch Keeps The Migration Budget : " << (testBatch_KeepsTheMigrationBudget() ? "Passed" : "Failed") << endl;
+		cout << "\nTest findCar Does Not Allocate : " << (testFindCar_NoAllocation() ? "Passed" : "Failed") << endl;
+		cout << "Test Insert Move And Emplace : " << (testInsert_MoveAndEmplace() ? "Passed" : "Failed") << endl;
+		cout << "\nTest Sharded Concurrent Writers : " << (testSharded_ConcurrentWriters() ? "Passed" : "Failed") << endl;
+		cout << "Test Concurrent Reads During Migration : " << (testConcurrentReads_DuringMigration() ? "Passed" : "Failed") << endl;
+		cout << "Test Concurrent Reads New Models : " << (testConcurrentReads_NewModels() ? "Passed" : "Failed") << endl;
+		cout << "Test Background Migration Drains Old Table : " << (testBackgroundMigration_DrainsOldTable() ? "Passed" : "Failed") << endl;
+		cout << "Test Background Migration Inserts Help A Bounded Step : " << (testBackgroundMigration_InsertsHelpABoundedStep() ? "Passed" : "Failed") << endl;
+		cout << "Test Migration Budget Bounds Every Call : " << (testMigrationBudget_BoundsEveryCall() ? "Passed" : "Failed") << endl;
+		cout << "\nTest changeProbPolicy Switches Live Table : " << (testChangeProbPolicy_SwitchesLiveTable() ? "Passed" : "Failed") << endl;
+		cout << "Test Adaptive Policy Reports Equal Hashes : " << (testAdaptivePolicy_ReportsEqualHashes() ? "Passed" : "Failed") << endl;
+		cout << "Test Adaptive Policy Undoes A Change That Did Not Help : " << (testAdaptivePolicy_UndoesAChangeThatDidNotHelp() ? "Passed" : "Failed") << endl;
+		cout << "Test Stats Counts Operations And Migration : " << (testStats_CountsOperationsAndMigration() ? "Passed" : "Failed") << endl;
+		cout << "Test Stats Group Probes Count Slots : " << (testStats_GroupProbesCountSlots() ? "Passed" : "Failed") << endl;
+		cout << "\nTest Snapshot Round Trip : " << (testSnapshot_RoundTrip() ? "Passed" : "Failed") << endl;
+		cout << "Test Journal Recovers On Top Of Snapshot : " << (testJournal_RecoversOnTopOfSnapshot() ? "Passed" : "Failed") << endl;
+		cout << "Test CSV Load Parallel Matches Sequential : " << (testLoadCsv_ParallelMatchesSequential() ? "Passed" : "Failed") << endl;
 
 		std::cout << "\nAll tests ran successfully!" << std::endl;
 	}
@@ -0,0 +1,88 @@
+// CMSC 341 - Fall 2023 - Project 4
+#include "sharded.h"
+
+ShardedCarDB::ShardedCarDB(int shards, int size, hash_fn hash, prob_t probing, keymode_t keyMode) {
+	m_hash = hash;
+	if (shards < 1)
+		shards = 1;
+	for (int i = 0; i < shards; i++)
+		m_shards.push_back(unique_ptr<Shard>(new Shard(size, hash, probing, keyMode)));
+}
+
+ShardedCarDB::Shard& ShardedCarDB::shardOf(string_view model, int dealer) const {
+	// the dealer is mixed in so that the cars of one model spread over all shards,
+	// and the murmur3 finalizer keeps the shard choice apart from the bucket index
+	unsigned int hash = m_hash(string(model)) ^ (static_cast<unsigned int>(dealer) * 0x9E3779B1u);
+	hash ^= hash >> 16;
+	hash *= 0x85EBCA6Bu;
+	hash ^= hash >> 13;
+	hash *= 0xC2B2AE35u;
+	hash ^= hash >> 16;
+	return *m_shards[hash % m_shards.size()];
+}
+
+bool ShardedCarDB::insert(const Car& car) {
+	Shard& shard = shardOf(car.getModel(), car.getDealer());
+	lock_guard<mutex> guard(shard.m_lock);
+	return shard.m_db.insert(car);
+}
+
+bool ShardedCarDB::remove(const Car& car) {
+	Shard& shard = shardOf(car.getModel(), car.getDealer());
+	lock_guard<mutex> guard(shard.m_lock);
+	return shard.m_db.remove(car);
+}
+
+Car ShardedCarDB::getCar(string_view model, int dealer) const {
+	Shard& shard = shardOf(model, dealer);
+	lock_guard<mutex> guard(shard.m_lock);
+	return shard.m_db.getCar(model, dealer);
+}
+
+bool ShardedCarDB::updateQuantity(const Car& car, int quantity) {
+	Shard& shard = shardOf(car.getModel(), car.getDealer());
+	lock_guard<mutex> guard(shard.m_lock);
+	return shard.m_db.updateQuantity(car, quantity);
+}
+
+qtyresult_t ShardedCarDB::addQuantity(string_view model, int dealer, int delta, int& quantity) {
+	Shard& shard = shardOf(model, dealer);
+	lock_guard<mutex> guard(shard.m_lock);
+	return shard.m_db.addQuantity(model, dealer, delta, quantity);
+}
+
+qtyresult_t ShardedCarDB::compareAndSetQuantity(string_view model, int dealer, int& expected, int desired) {
+	Shard& shard = shardOf(model, dealer);
+	lock_guard<mutex> guard(shard.m_lock);
+	return shard.m_db.compareAndSetQuantity(model, dealer, expected, desired);
+}
+
+void ShardedCarDB::changeProbPolicy(prob_t policy) {
+	for (const unique_ptr<Shard>& shard : m_shards) {
+		lock_guard<mutex> guard(shard->m_lock);
+		shard->m_db.changeProbPolicy(policy);
+	}
+}
+
+float ShardedCarDB::lambda() const {
+	// shards are weighted by their capacity, as if they were one table
+	long long occupied = 0, capacity = 0;
+	for (const unique_ptr<Shard>& shard : m_shards) {
+		lock_guard<mutex> guard(shard->m_lock);
+		occupied += shard->m_db.m_currentSize + shard->m_db.m_currNumDeleted;
+		capacity += shard->m_db.m_currentCap;
+	}
+	return static_cast<float>(occupied) / capacity;
+}
+
+float ShardedCarDB::deletedRatio() const {
+	long long deleted = 0, size = 0;
+	for (const unique_ptr<Shard>& shard : m_shards) {
+		lock_guard<mutex> guard(shard->m_lock);
+		deleted += shard->m_db.m_currNumDeleted;
+		size += shard->m_db.m_currentSize;
+	}
+	if (size == 0)
+		return 0.0;	// Avoid division by zero
+	return static_cast<float>(deleted) / size;
+}
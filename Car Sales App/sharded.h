@@ -0,0 +1,45 @@
+// CMSC 341 - Fall 2023 - Project 4
+#ifndef SHARDED_H
+#define SHARDED_H
+#include <memory>
+#include <mutex>
+#include "dealer.h"
+
+// A CarDB split into independent shards for use from several threads. Every key
+// goes to the shard picked by its hash; each shard is a CarDB with its own lock
+// and its own incremental rehash, so threads working on different shards never wait
+// for each other.
+class ShardedCarDB {
+public:
+	friend class Grader;
+	friend class Tester;
+	friend class Bench;
+	// shards independent tables, each starting at the given size
+	ShardedCarDB(int shards, int size, hash_fn hash, prob_t probing, keymode_t keyMode = MODELKEY);
+	ShardedCarDB(const ShardedCarDB&) = delete;
+	ShardedCarDB& operator=(const ShardedCarDB&) = delete;
+	// the same operations as CarDB, each locking only the shard of its key
+	bool insert(const Car& car);
+	bool remove(const Car& car);
+	Car getCar(string_view model, int dealer) const;
+	bool updateQuantity(const Car& car, int quantity);
+	qtyresult_t addQuantity(string_view model, int dealer, int delta, int& quantity);
+	qtyresult_t compareAndSetQuantity(string_view model, int dealer, int& expected, int desired);
+	void changeProbPolicy(prob_t policy);	// applied to every shard
+	// load factor and deleted ratio over the current tables of all shards
+	float lambda() const;
+	float deletedRatio() const;
+	int shardCount() const { return static_cast<int>(m_shards.size()); }
+private:
+	// aligned so that the locks of neighbouring shards do not share a cache line
+	struct alignas(64) Shard {
+		Shard(int size, hash_fn hash, prob_t probing, keymode_t keyMode) : m_db(size, hash, probing, keyMode) {}
+		mutable mutex m_lock;
+		CarDB m_db;
+	};
+	hash_fn m_hash;
+	vector<unique_ptr<Shard>> m_shards;
+
+	Shard& shardOf(string_view model, int dealer) const;	// shard that owns the key
+};
+#endif
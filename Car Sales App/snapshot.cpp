@@ -0,0 +1,283 @@
+// CMSC 341 - Fall 2023 - Project 4
+// Binary snapshots of a CarDB
+//
+// A snapshot holds the current table of a database exactly as it is in memory, so
+// opening one maps the slots instead of inserting every car again. All offsets are
+// from the start of the file and all numbers are in the byte order of the writer,
+// which the header records. Layout:
+//
+//   SnapshotHeader
+//   name offsets     m_models + 1 uint64, name k is arena[offset k, offset k+1)
+//   name arena       the model names back to back, without terminators
+//   model hashes     m_models uint32, m_hash of every model name (0 for a key hash)
+//   model totals     m_models ModelTotals, quantity and cars of every model ID
+//   control bytes    m_capacity bytes of a GROUPPROBE table, absent otherwise
+//   slots            m_capacity CarSlot, starting on a SNAPSHOT_ALIGN boundary
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "dealer.h"
+
+static const char SNAPSHOT_MAGIC[8] = { 'C', 'A', 'R', 'D', 'B', 'S', 'N', 'P' };
+static const uint32_t SNAPSHOT_VERSION = 2;
+static const uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+// slots start on a page boundary of any page size up to 64 KiB, so they can be mapped
+static const uint64_t SNAPSHOT_ALIGN = 65536;
+
+struct SnapshotHeader {
+	char m_magic[8];
+	uint32_t m_version;
+	uint32_t m_byteOrder;
+	uint32_t m_slotSize;        // sizeof(CarSlot) of the writer
+	uint32_t m_probing;
+	uint32_t m_keyMode;
+	uint32_t m_keyHashed;       // 1 when the table was hashed with a key_hash_fn
+	uint64_t m_capacity;
+	uint64_t m_size;            // m_currentSize and m_currNumDeleted of the table
+	uint64_t m_numDeleted;
+	uint64_t m_models;          // model IDs, including the reserved 0
+	uint64_t m_namesOffset;
+	uint64_t m_arenaOffset;
+	uint64_t m_hashesOffset;
+	uint64_t m_totalsOffset;
+	uint64_t m_ctrlOffset;      // 0 when the table has no control bytes
+	uint64_t m_slotsOffset;
+	uint64_t m_fileSize;
+};
+
+// fsync of a file or a directory, so what was written or renamed in it is on disk
+static bool syncPath(const string& path) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	bool synced = fsync(fd) == 0;
+	close(fd);
+	return synced;
+}
+
+static bool readAt(int fd, void* buffer, size_t length, uint64_t offset) {
+	char* out = static_cast<char*>(buffer);
+	while (length > 0) {
+		ssize_t got = pread(fd, out, length, static_cast<off_t>(offset));
+		if (got <= 0)
+			return false;
+		out += got;
+		length -= static_cast<size_t>(got);
+		offset += static_cast<uint64_t>(got);
+	}
+	return true;
+}
+
+bool CarDB::saveSnapshot(const string& path) {
+	unique_lock<recursive_mutex> lock = writerLock();
+	// only the current table is written, so a migration has to finish first
+	while (m_oldTable != nullptr)
+		migrateStep(m_oldCap);
+
+	SnapshotHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.m_magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+	header.m_version = SNAPSHOT_VERSION;
+	header.m_byteOrder = SNAPSHOT_BYTE_ORDER;
+	header.m_slotSize = sizeof(CarSlot);
+	header.m_probing = m_currProbing;
+	header.m_keyMode = m_keyMode;
+	header.m_keyHashed = (m_keyHash != nullptr) ? 1 : 0;
+	header.m_capacity = m_currentCap;
+	header.m_size = m_currentSize;
+	header.m_numDeleted = m_currNumDeleted;
+	header.m_models = m_models.size();
+
+	vector<uint64_t> offsets(header.m_models + 1);
+	for (uint32_t id = 0; id < header.m_models; id++)
+		offsets[id + 1] = offsets[id] + m_models.name(id).size();
+	vector<uint32_t> hashes(header.m_models);
+	for (uint32_t id = 0; id < header.m_models; id++)
+		hashes[id] = m_modelHashes[id];
+
+	header.m_namesOffset = sizeof(header);
+	header.m_arenaOffset = header.m_namesOffset + offsets.size() * sizeof(uint64_t);
+	// the totals are saved so that opening does not count them from every slot
+	vector<ModelTotals> totals(header.m_models, ModelTotals{ 0, 0 });
+	copy(m_modelTotals.begin(), m_modelTotals.begin() + min<size_t>(m_modelTotals.size(), totals.size()), totals.begin());
+
+	header.m_hashesOffset = header.m_arenaOffset + offsets.back();
+	header.m_totalsOffset = header.m_hashesOffset + hashes.size() * sizeof(uint32_t);
+	uint64_t end = header.m_totalsOffset + totals.size() * sizeof(ModelTotals);
+	if (m_currentCtrl != nullptr) {
+		header.m_ctrlOffset = end;
+		end += header.m_capacity;
+	}
+	header.m_slotsOffset = (end + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+	header.m_fileSize = header.m_slotsOffset + header.m_capacity * sizeof(CarSlot);
+
+	// written next to the target, synced and renamed over it, so a crash leaves the old
+	// snapshot or the whole new one
+	string temporary = path + ".tmp";
+	{
+		ofstream out(temporary, ios::binary | ios::trunc);
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint64_t));
+		for (uint32_t id = 0; id < header.m_models; id++)
+			out.write(m_models.name(id).data(), m_models.name(id).size());
+		out.write(reinterpret_cast<const char*>(hashes.data()), hashes.size() * sizeof(uint32_t));
+		out.write(reinterpret_cast<const char*>(totals.data()), totals.size() * sizeof(ModelTotals));
+		if (m_currentCtrl != nullptr)
+			out.write(reinterpret_cast<const char*>(m_currentCtrl), header.m_capacity);
+		vector<char> padding(header.m_slotsOffset - end, 0);
+		out.write(padding.data(), padding.size());
+		out.write(reinterpret_cast<const char*>(m_currentTable), header.m_capacity * sizeof(CarSlot));
+		out.flush();
+		if (!out) {
+			::remove(temporary.c_str());
+			return false;
+		}
+	}
+	if (!syncPath(temporary)) {
+		::remove(temporary.c_str());
+		return false;
+	}
+	if (rename(temporary.c_str(), path.c_str()) != 0)
+		return false;
+	// the rename is durable once its directory is synced; until then the journal is
+	// all that holds the changes since the last snapshot
+	size_t slash = path.rfind('/');
+	string directory = (slash == string::npos) ? "." : (slash == 0) ? "/" : path.substr(0, slash);
+	if (!syncPath(directory))
+		return false;
+	// the snapshot holds every change journalled so far; replaying them on top of it
+	// after a crash in between would do no harm, each record sets the state of its key
+	if (m_journal != nullptr)
+		m_journal->truncate();
+	return true;
+}
+
+// Opens and checks the header, -1 if the file is no snapshot this build can read
+static int openSnapshotFile(const string& path, SnapshotHeader& header, bool keyHashed) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return -1;
+	struct stat info;
+	bool valid = fstat(fd, &info) == 0 && readAt(fd, &header, sizeof(header), 0)
+		&& memcmp(header.m_magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0
+		&& header.m_version == SNAPSHOT_VERSION && header.m_byteOrder == SNAPSHOT_BYTE_ORDER
+		&& header.m_slotSize == sizeof(CarSlot) && header.m_keyHashed == (keyHashed ? 1u : 0u)
+		&& header.m_probing >= QUADRATIC && header.m_probing <= ROBINHOOD
+		&& header.m_capacity > 0 && header.m_models > 0 && header.m_models < header.m_fileSize
+		&& header.m_fileSize == static_cast<uint64_t>(info.st_size)
+		&& header.m_slotsOffset % SNAPSHOT_ALIGN == 0
+		&& header.m_slotsOffset + header.m_capacity * sizeof(CarSlot) == header.m_fileSize;
+	if (!valid) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+unique_ptr<CarDB> CarDB::openSnapshot(const string& path, hash_fn hash) {
+	SnapshotHeader header;
+	int fd = openSnapshotFile(path, header, false);
+	if (fd < 0)
+		return nullptr;
+	unique_ptr<CarDB> db(new CarDB(MINPRIME, hash, static_cast<prob_t>(header.m_probing), static_cast<keymode_t>(header.m_keyMode)));
+	bool loaded = db->loadSnapshot(fd, header);
+	close(fd);
+	return loaded ? std::move(db) : nullptr;
+}
+
+unique_ptr<CarDB> CarDB::openSnapshot(const string& path, key_hash_fn hash) {
+	SnapshotHeader header;
+	int fd = openSnapshotFile(path, header, true);
+	if (fd < 0)
+		return nullptr;
+	unique_ptr<CarDB> db(new CarDB(MINPRIME, hash, static_cast<prob_t>(header.m_probing)));
+	bool loaded = db->loadSnapshot(fd, header);
+	close(fd);
+	return loaded ? std::move(db) : nullptr;
+}
+
+bool CarDB::loadSnapshot(int fd, const SnapshotHeader& header) {
+	// model names keep their IDs, the slots refer to them
+	vector<uint64_t> offsets(header.m_models + 1);
+	if (!readAt(fd, offsets.data(), offsets.size() * sizeof(uint64_t), header.m_namesOffset)
+		|| offsets[0] != 0 || offsets.back() > header.m_fileSize
+		|| header.m_arenaOffset + offsets.back() != header.m_hashesOffset)
+		return false;
+	vector<char> arena(offsets.back());
+	vector<uint32_t> hashes(header.m_models);
+	vector<ModelTotals> totals(header.m_models);
+	if (header.m_totalsOffset != header.m_hashesOffset + hashes.size() * sizeof(uint32_t)
+		|| header.m_totalsOffset + totals.size() * sizeof(ModelTotals) > header.m_slotsOffset)
+		return false;
+	if (!readAt(fd, arena.data(), arena.size(), header.m_arenaOffset)
+		|| !readAt(fd, hashes.data(), hashes.size() * sizeof(uint32_t), header.m_hashesOffset)
+		|| !readAt(fd, totals.data(), totals.size() * sizeof(ModelTotals), header.m_totalsOffset))
+		return false;
+	for (uint32_t id = 1; id < header.m_models; id++) {
+		if (offsets[id + 1] < offsets[id])
+			return false;
+		if (m_models.intern(string_view(arena.data() + offsets[id], offsets[id + 1] - offsets[id])) != id)
+			return false;	// a name appears twice
+		m_modelHashes.push_back(hashes[id]);	// cached, the names are not hashed again
+	}
+	// one name hashed again tells whether the hash function is the one of the writer
+	if (m_hash != nullptr && header.m_models > 1 && m_hash(m_models.name(1)) != hashes[1])
+		return false;
+
+	signed char* ctrl = newCtrl(header.m_capacity, static_cast<prob_t>(header.m_probing));
+	if (ctrl != nullptr) {
+		vector<signed char> bytes(header.m_capacity);
+		if (header.m_ctrlOffset == 0 || !readAt(fd, bytes.data(), bytes.size(), header.m_ctrlOffset)) {
+			delete[] ctrl;
+			return false;
+		}
+		for (uint64_t i = 0; i < header.m_capacity; i++)
+			setCtrl(ctrl, header.m_capacity, i, bytes[i]);
+	}
+
+	size_t length = header.m_capacity * sizeof(CarSlot);
+	CarSlot* table = nullptr;
+	// pages of the file back the table and stay untouched, a write copies its page
+	void* mapped = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, static_cast<off_t>(header.m_slotsOffset));
+	if (mapped != MAP_FAILED)
+		table = static_cast<CarSlot*>(mapped);
+	else {
+		table = newTable(header.m_capacity);
+		if (!readAt(fd, table, length, header.m_slotsOffset)) {
+			free(table);
+			delete[] ctrl;
+			return false;
+		}
+	}
+
+	free(m_currentTable);
+	delete[] m_currentCtrl;
+	m_currentTable = table;
+	m_currentCtrl = ctrl;
+	if (mapped != MAP_FAILED) {
+		m_mappedTable = table;
+		m_mappedLength = length;
+	}
+	m_currentCap = header.m_capacity;
+	m_currentMod = FastMod(header.m_capacity);
+	m_currentSize = header.m_size;
+	m_currNumDeleted = header.m_numDeleted;
+	publishTables();
+
+	// so does one car for a key hash, and its model ID must be known; the other slots are
+	// taken as written, checking them would read every page of the table
+	for (long long i = 0; i < m_currentCap; i++) {
+		if (m_currentTable[i].m_used) {
+			if (m_currentTable[i].m_modelId >= m_models.size()
+				|| hashKey(m_currentTable[i].m_modelId, m_currentTable[i].m_dealer) != m_currentTable[i].m_hashCode)
+				return false;
+			break;
+		}
+	}
+	m_modelTotals = std::move(totals);
+	return true;
+}